@@ -0,0 +1,123 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#include "heal-config.h"
+
+#include <xlator.h>
+#include <statedump.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "heal-compress.h"
+
+int32_t heal_compress_supported(uint32_t algorithm)
+{
+    switch (algorithm)
+    {
+#ifdef HAVE_LZ4
+        case HEAL_COMPRESS_LZ4:
+            return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case HEAL_COMPRESS_ZSTD:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+/* Decompresses 'src' into 'dst'. The decompressed data must fill 'dst'
+ * exactly, otherwise the data is considered corrupted. */
+int32_t heal_decompress(uint32_t algorithm, void * src, size_t src_length, void * dst, size_t dst_length)
+{
+#ifdef HAVE_LZ4
+    int32_t length;
+#endif
+#ifdef HAVE_ZSTD
+    size_t size;
+#endif
+
+    switch (algorithm)
+    {
+#ifdef HAVE_LZ4
+        case HEAL_COMPRESS_LZ4:
+            length = LZ4_decompress_safe(src, dst, src_length, dst_length);
+            if ((length < 0) || (length != dst_length))
+            {
+                return EIO;
+            }
+            return 0;
+#endif
+#ifdef HAVE_ZSTD
+        case HEAL_COMPRESS_ZSTD:
+            size = ZSTD_decompress(dst, dst_length, src, src_length);
+            if (ZSTD_isError(size) || (size != dst_length))
+            {
+                return EIO;
+            }
+            return 0;
+#endif
+        default:
+            return EOPNOTSUPP;
+    }
+}
+
+void heal_compress_account(heal_compress_stats_t * stats, size_t compressed, size_t decompressed, uint64_t usecs, int32_t error)
+{
+    if (error != 0)
+    {
+        __sync_fetch_and_add(&stats->errors, 1);
+
+        return;
+    }
+
+    __sync_fetch_and_add(&stats->writes, 1);
+    __sync_fetch_and_add(&stats->compressed, compressed);
+    __sync_fetch_and_add(&stats->decompressed, decompressed);
+    __sync_fetch_and_add(&stats->usecs, usecs);
+}
+
+void heal_compress_dump(heal_compress_stats_t * stats)
+{
+    uint64_t compressed, decompressed, usecs;
+
+    compressed = stats->compressed;
+    decompressed = stats->decompressed;
+    usecs = stats->usecs;
+
+    gf_proc_dump_write("compress.writes", "%lu", stats->writes);
+    gf_proc_dump_write("compress.errors", "%lu", stats->errors);
+    gf_proc_dump_write("compress.compressed-bytes", "%lu", compressed);
+    gf_proc_dump_write("compress.decompressed-bytes", "%lu", decompressed);
+    if (compressed > 0)
+    {
+        gf_proc_dump_write("compress.ratio", "%.2f", (double)decompressed / compressed);
+    }
+    if (usecs > 0)
+    {
+        gf_proc_dump_write("compress.decode-throughput", "%lu MB/s", decompressed / usecs);
+    }
+}
@@ -0,0 +1,45 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __HEAL_COMPRESS_H__
+#define __HEAL_COMPRESS_H__
+
+#define HEAL_COMPRESS_NONE 0
+#define HEAL_COMPRESS_LZ4  1
+#define HEAL_COMPRESS_ZSTD 2
+
+/* Maximum size of the decompressed data of a single heal write. */
+#define HEAL_COMPRESS_MAX_SIZE (4 * 1024 * 1024)
+
+typedef struct _heal_compress_stats
+{
+    uint64_t writes;
+    uint64_t compressed;
+    uint64_t decompressed;
+    uint64_t usecs;
+    uint64_t errors;
+} heal_compress_stats_t;
+
+int32_t heal_compress_supported(uint32_t algorithm);
+int32_t heal_decompress(uint32_t algorithm, void * src, size_t src_length, void * dst, size_t dst_length);
+void heal_compress_account(heal_compress_stats_t * stats, size_t compressed, size_t decompressed, uint64_t usecs, int32_t error);
+void heal_compress_dump(heal_compress_stats_t * stats);
+
+#endif /* __HEAL_COMPRESS_H__ */
@@ -0,0 +1,274 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "byte-order.h"
+#include <xlator.h>
+#include <statedump.h>
+
+#include "heal.h"
+#include "heal-heat.h"
+
+#define HEAL_HEAT_DUMP 10
+
+static __thread uint32_t heal_heat_tick = 0;
+
+static uint32_t heal_heat_hash(uuid_t gfid)
+{
+    uint32_t hash;
+    int32_t i;
+
+    hash = 0;
+    for (i = 12; i < 16; i++)
+    {
+        hash = (hash << 8) | gfid[i];
+    }
+
+    return hash % HEAL_HEAT_BUCKETS;
+}
+
+static uint64_t heal_heat_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Halves the score once for each half life elapsed. The remaining fraction
+ * of a half life is approximated linearly, which is precise enough to rank
+ * inodes and avoids floating point math in the data path. */
+static uint64_t heal_heat_decay(uint64_t score, uint64_t elapsed, uint64_t half_life)
+{
+    uint64_t halvings, fraction, half;
+
+    halvings = elapsed / half_life;
+    if (halvings >= 64)
+    {
+        return 0;
+    }
+    score >>= halvings;
+    elapsed -= halvings * half_life;
+
+    // The fraction is computed in 16 bits fixed point so that multiplying
+    // it by the score can't overflow.
+    fraction = (elapsed << 16) / half_life;
+    half = score / 2;
+
+    return score - (half >> 16) * fraction - (((half & 0xFFFF) * fraction) >> 16);
+}
+
+static void __heal_heat_update(heal_heat_t * heat, heal_heat_entry_t * entry, uint64_t now)
+{
+    uint64_t half_life;
+
+    if (now > entry->time)
+    {
+        half_life = (uint64_t)heat->half_life * 1000;
+        entry->read = heal_heat_decay(entry->read, now - entry->time, half_life);
+        entry->write = heal_heat_decay(entry->write, now - entry->time, half_life);
+        entry->time = now;
+    }
+}
+
+void heal_heat_init(heal_heat_t * heat)
+{
+    int32_t i;
+
+    for (i = 0; i < HEAL_HEAT_STRIPES; i++)
+    {
+        LOCK_INIT(&heat->locks[i]);
+    }
+    memset(heat->entries, 0, sizeof(heat->entries));
+}
+
+void heal_heat_destroy(heal_heat_t * heat)
+{
+    int32_t i;
+
+    for (i = 0; i < HEAL_HEAT_STRIPES; i++)
+    {
+        LOCK_DESTROY(&heat->locks[i]);
+    }
+}
+
+/* Accounts an access of 'bytes' bytes to the inode. Only one out of each
+ * 'sample_rate' accesses of a thread is recorded, with its weight scaled
+ * accordingly. */
+void heal_heat_account(heal_heat_t * heat, uuid_t gfid, int32_t type, uint64_t bytes)
+{
+    heal_heat_entry_t * entries, * entry;
+    uint64_t now, weight;
+    uint32_t bucket, rate;
+    int32_t i;
+
+    rate = heat->sample_rate;
+    if ((rate == 0) || ((++heal_heat_tick % rate) != 0) || uuid_is_null(gfid))
+    {
+        return;
+    }
+
+    weight = bytes * rate;
+    now = heal_heat_now();
+    bucket = heal_heat_hash(gfid);
+    entries = heat->entries[bucket];
+
+    LOCK(&heat->locks[bucket % HEAL_HEAT_STRIPES]);
+
+    entry = NULL;
+    for (i = 0; i < HEAL_HEAT_WAYS; i++)
+    {
+        __heal_heat_update(heat, &entries[i], now);
+        if (uuid_compare(entries[i].gfid, gfid) == 0)
+        {
+            entry = &entries[i];
+
+            break;
+        }
+        if ((entry == NULL) || (entries[i].read + entries[i].write < entry->read + entry->write))
+        {
+            entry = &entries[i];
+        }
+    }
+    if (uuid_compare(entry->gfid, gfid) != 0)
+    {
+        uuid_copy(entry->gfid, gfid);
+        entry->read = 0;
+        entry->write = 0;
+        entry->time = now;
+    }
+    if (type == HEAL_HEAT_WRITE)
+    {
+        entry->write += weight;
+    }
+    else
+    {
+        entry->read += weight;
+    }
+
+    UNLOCK(&heat->locks[bucket % HEAL_HEAT_STRIPES]);
+}
+
+static int heal_heat_compare(const void * a, const void * b)
+{
+    const heal_heat_entry_t * ea = a, * eb = b;
+    uint64_t ha, hb;
+
+    // Writes leave more data to heal than reads, so they weigh double.
+    ha = 2 * ea->write + ea->read;
+    hb = 2 * eb->write + eb->read;
+
+    return (ha < hb) - (ha > hb);
+}
+
+/* Returns up to 'limit' of the hottest inodes (all of them if 'limit' is
+ * 0), ordered by decreasing heat. */
+int32_t heal_heat_collect(heal_heat_t * heat, uint32_t limit, void ** data, uint32_t * length)
+{
+    heal_heat_entry_t * entries;
+    heal_heat_header_t * header;
+    heal_heat_record_t * record;
+    uint64_t now;
+    uint32_t count, bucket, i;
+
+    entries = GF_MALLOC(sizeof(heat->entries), gf_heal_mt_heal_heat_entry_t);
+    if (entries == NULL)
+    {
+        return ENOMEM;
+    }
+
+    now = heal_heat_now();
+    count = 0;
+    for (bucket = 0; bucket < HEAL_HEAT_BUCKETS; bucket++)
+    {
+        LOCK(&heat->locks[bucket % HEAL_HEAT_STRIPES]);
+
+        for (i = 0; i < HEAL_HEAT_WAYS; i++)
+        {
+            __heal_heat_update(heat, &heat->entries[bucket][i], now);
+            if (!uuid_is_null(heat->entries[bucket][i].gfid) && ((heat->entries[bucket][i].read | heat->entries[bucket][i].write) != 0))
+            {
+                entries[count++] = heat->entries[bucket][i];
+            }
+        }
+
+        UNLOCK(&heat->locks[bucket % HEAL_HEAT_STRIPES]);
+    }
+
+    qsort(entries, count, sizeof(heal_heat_entry_t), heal_heat_compare);
+    if ((limit != 0) && (count > limit))
+    {
+        count = limit;
+    }
+
+    *length = sizeof(heal_heat_header_t) + count * sizeof(heal_heat_record_t);
+    *data = GF_MALLOC(*length, gf_heal_mt_uint8_t);
+    if (*data == NULL)
+    {
+        GF_FREE(entries);
+
+        return ENOMEM;
+    }
+
+    header = *data;
+    header->count = hton32(count);
+    record = (heal_heat_record_t *)(header + 1);
+    for (i = 0; i < count; i++)
+    {
+        uuid_copy(record[i].gfid, entries[i].gfid);
+        record[i].read = hton64(entries[i].read);
+        record[i].write = hton64(entries[i].write);
+    }
+
+    GF_FREE(entries);
+
+    return 0;
+}
+
+void heal_heat_dump(heal_heat_t * heat)
+{
+    char key[GF_DUMP_MAX_BUF_LEN];
+    heal_heat_header_t * header;
+    heal_heat_record_t * record;
+    void * data;
+    uint32_t length, count, i;
+
+    gf_proc_dump_write("heat.sample-rate", "%u", heat->sample_rate);
+    gf_proc_dump_write("heat.half-life", "%u", heat->half_life);
+
+    if (heal_heat_collect(heat, HEAL_HEAT_DUMP, &data, &length) != 0)
+    {
+        return;
+    }
+
+    header = data;
+    count = ntoh32(header->count);
+    record = (heal_heat_record_t *)(header + 1);
+    for (i = 0; i < count; i++)
+    {
+        snprintf(key, sizeof(key), "heat.%u", i);
+        gf_proc_dump_write(key, "%s %lu %lu", uuid_utoa(record[i].gfid), ntoh64(record[i].read), ntoh64(record[i].write));
+    }
+
+    GF_FREE(data);
+}
@@ -0,0 +1,72 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __HEAL_HEAT_H__
+#define __HEAL_HEAT_H__
+
+#define HEAL_HEAT_BUCKETS 1024
+#define HEAL_HEAT_WAYS    4
+#define HEAL_HEAT_STRIPES 32
+
+#define HEAL_HEAT_READ  0
+#define HEAL_HEAT_WRITE 1
+
+/* Decayed number of bytes read and written on an inode. Scores are halved
+ * every 'half_life' seconds. */
+typedef struct _heal_heat_entry
+{
+    uuid_t gfid;
+    uint64_t read;
+    uint64_t write;
+    uint64_t time;
+} heal_heat_entry_t;
+
+/* Set associative table of the hottest inodes. When a bucket is full, the
+ * coldest entry is replaced, so memory use is bounded and inodes that are
+ * accessed often are never evicted by a stream of cold ones. */
+typedef struct _heal_heat
+{
+    gf_lock_t locks[HEAL_HEAT_STRIPES];
+    heal_heat_entry_t entries[HEAL_HEAT_BUCKETS][HEAL_HEAT_WAYS];
+    uint32_t sample_rate;
+    uint32_t half_life;
+} heal_heat_t;
+
+/* Result of heal_heat_collect(). 'count' records follow the header, sorted
+ * from the hottest to the coldest. All fields are in network byte order. */
+typedef struct _heal_heat_header
+{
+    uint32_t count;
+} __attribute__((__packed__)) heal_heat_header_t;
+
+typedef struct _heal_heat_record
+{
+    uuid_t gfid;
+    uint64_t read;
+    uint64_t write;
+} __attribute__((__packed__)) heal_heat_record_t;
+
+void heal_heat_init(heal_heat_t * heat);
+void heal_heat_destroy(heal_heat_t * heat);
+void heal_heat_account(heal_heat_t * heat, uuid_t gfid, int32_t type, uint64_t bytes);
+int32_t heal_heat_collect(heal_heat_t * heat, uint32_t limit, void ** data, uint32_t * length);
+void heal_heat_dump(heal_heat_t * heat);
+
+#endif /* __HEAL_HEAT_H__ */
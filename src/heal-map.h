@@ -0,0 +1,61 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __HEAL_MAP_H__
+#define __HEAL_MAP_H__
+
+/* The encoded map must fit in a single xattr, sharing the 4 KB available
+ * on ext4 with the other xattrs of the file. */
+#define HEAL_MAP_MAX_BLOCKS 512
+
+/* Checksums of the data written by a heal. 'crc' and 'fill' hold the state
+ * of the block currently being computed. 'version' is the data version of
+ * the inode when the map was completed. It's not stored. */
+typedef struct _heal_map
+{
+    uint64_t size;
+    uint64_t block_size;
+    uint32_t count;
+    uint32_t index;
+    uint64_t fill;
+    uint32_t crc;
+    int32_t invalid;
+    uint64_t version;
+    uint32_t blocks[];
+} heal_map_t;
+
+/* Header of the map stored in HEAL_KEY_MAP. It's followed by 'count'
+ * checksums. All fields are stored in network byte order. */
+typedef struct _heal_map_header
+{
+    uint64_t size;
+    uint64_t block_size;
+    uint32_t count;
+} __attribute__((__packed__)) heal_map_header_t;
+
+uint32_t heal_crc32c(uint32_t crc, const void * data, size_t length);
+heal_map_t * heal_map_new(uint64_t size, uint64_t block_size);
+void heal_map_destroy(heal_map_t * map);
+void heal_map_update(heal_map_t * map, struct iovec * vector, int32_t count, size_t length);
+int32_t heal_map_finish(heal_map_t * map);
+int32_t heal_map_encode(heal_map_t * map, void ** data, uint32_t * length);
+heal_map_t * heal_map_decode(void * data, uint32_t length);
+
+#endif /* __HEAL_MAP_H__ */
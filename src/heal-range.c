@@ -0,0 +1,273 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#include "byte-order.h"
+#include <xlator.h>
+
+#include "heal.h"
+#include "heal-range.h"
+
+void heal_ranges_init(heal_ranges_t * set)
+{
+    set->count = 0;
+    set->size = 0;
+    set->ranges = NULL;
+}
+
+void heal_ranges_clear(heal_ranges_t * set)
+{
+    GF_FREE(set->ranges);
+    heal_ranges_init(set);
+}
+
+/* Makes 'dst' an independent copy of 'src'. 'dst' must be empty. */
+int32_t heal_ranges_copy(heal_ranges_t * dst, heal_ranges_t * src)
+{
+    if (src->count > 0)
+    {
+        dst->ranges = GF_MALLOC(sizeof(heal_range_t) * src->count, gf_heal_mt_heal_range_t);
+        if (dst->ranges == NULL)
+        {
+            return ENOMEM;
+        }
+        memcpy(dst->ranges, src->ranges, sizeof(heal_range_t) * src->count);
+    }
+    dst->count = src->count;
+    dst->size = src->count;
+
+    return 0;
+}
+
+/* Returns the index of the first range that ends at or after 'start'. */
+static uint32_t heal_ranges_find(heal_ranges_t * set, uint64_t start)
+{
+    uint32_t first, last, mid;
+
+    first = 0;
+    last = set->count;
+    while (first < last)
+    {
+        mid = (first + last) / 2;
+        if (set->ranges[mid].end < start)
+        {
+            first = mid + 1;
+        }
+        else
+        {
+            last = mid;
+        }
+    }
+
+    return first;
+}
+
+int32_t heal_ranges_contains(heal_ranges_t * set, uint64_t start, uint64_t end)
+{
+    uint32_t i;
+
+    i = heal_ranges_find(set, end);
+
+    return (i < set->count) && (set->ranges[i].start <= start);
+}
+
+int32_t heal_ranges_overlaps(heal_ranges_t * set, uint64_t start, uint64_t end)
+{
+    uint32_t i;
+
+    i = heal_ranges_find(set, start + 1);
+
+    return (i < set->count) && (set->ranges[i].start < end);
+}
+
+/* Returns true if [start, end) overlaps or is adjacent to some range of the
+ * set, so adding it doesn't increase the number of ranges. */
+int32_t heal_ranges_touches(heal_ranges_t * set, uint64_t start, uint64_t end)
+{
+    uint32_t i;
+
+    i = heal_ranges_find(set, start);
+
+    return (i < set->count) && (set->ranges[i].start <= end);
+}
+
+/* Removes from the set all the ranges that end at or before 'offset'. */
+void heal_ranges_trim(heal_ranges_t * set, uint64_t offset)
+{
+    uint32_t i;
+
+    i = heal_ranges_find(set, offset + 1);
+    if (i > 0)
+    {
+        memmove(set->ranges, set->ranges + i, sizeof(heal_range_t) * (set->count - i));
+        set->count -= i;
+    }
+}
+
+static void heal_ranges_compact(heal_ranges_t * set)
+{
+    uint64_t gap, min;
+    uint32_t i, idx;
+
+    while (set->count > HEAL_RANGES_MAX)
+    {
+        idx = 0;
+        min = UINT64_MAX;
+        for (i = 0; i < set->count - 1; i++)
+        {
+            gap = set->ranges[i + 1].start - set->ranges[i].end;
+            if (gap < min)
+            {
+                min = gap;
+                idx = i;
+            }
+        }
+
+        set->ranges[idx].end = set->ranges[idx + 1].end;
+        memmove(set->ranges + idx + 1, set->ranges + idx + 2, sizeof(heal_range_t) * (set->count - idx - 2));
+        set->count--;
+    }
+}
+
+/* Adds the range [start, end) to the set, merging it with any overlapping
+ * or adjacent range. */
+int32_t heal_ranges_add(heal_ranges_t * set, uint64_t start, uint64_t end)
+{
+    heal_range_t * ranges;
+    uint32_t i, j, size;
+
+    if (start >= end)
+    {
+        return 0;
+    }
+
+    i = heal_ranges_find(set, start);
+    for (j = i; (j < set->count) && (set->ranges[j].start <= end); j++)
+    {
+        if (set->ranges[j].start < start)
+        {
+            start = set->ranges[j].start;
+        }
+        if (set->ranges[j].end > end)
+        {
+            end = set->ranges[j].end;
+        }
+    }
+
+    if (i == j)
+    {
+        if (set->count == set->size)
+        {
+            size = (set->size == 0) ? 4 : set->size * 2;
+            ranges = GF_MALLOC(sizeof(heal_range_t) * size, gf_heal_mt_heal_range_t);
+            if (ranges == NULL)
+            {
+                return ENOMEM;
+            }
+            if (set->count > 0)
+            {
+                memcpy(ranges, set->ranges, sizeof(heal_range_t) * set->count);
+            }
+            GF_FREE(set->ranges);
+            set->ranges = ranges;
+            set->size = size;
+        }
+        memmove(set->ranges + i + 1, set->ranges + i, sizeof(heal_range_t) * (set->count - i));
+        set->count++;
+    }
+    else if (j > i + 1)
+    {
+        memmove(set->ranges + i + 1, set->ranges + j, sizeof(heal_range_t) * (set->count - j));
+        set->count -= j - i - 1;
+    }
+
+    set->ranges[i].start = start;
+    set->ranges[i].end = end;
+
+    heal_ranges_compact(set);
+
+    return 0;
+}
+
+int32_t heal_ranges_encode(heal_ranges_t * set, uint64_t generation, void ** data, uint32_t * length)
+{
+    heal_ranges_header_t * header;
+    uint64_t * ranges;
+    uint32_t i;
+
+    *length = sizeof(heal_ranges_header_t) + sizeof(uint64_t) * 2 * set->count;
+    header = GF_MALLOC(*length, gf_heal_mt_uint8_t);
+    if (header == NULL)
+    {
+        return ENOMEM;
+    }
+
+    header->generation = hton64(generation);
+    header->count = hton32(set->count);
+
+    ranges = (uint64_t *)(header + 1);
+    for (i = 0; i < set->count; i++)
+    {
+        *ranges++ = hton64(set->ranges[i].start);
+        *ranges++ = hton64(set->ranges[i].end);
+    }
+
+    *data = header;
+
+    return 0;
+}
+
+int32_t heal_ranges_decode(heal_ranges_t * set, void * data, uint32_t length, uint64_t * generation)
+{
+    heal_ranges_header_t * header;
+    uint64_t * ranges;
+    uint64_t start, end;
+    uint32_t i, count;
+    int32_t error;
+
+    header = data;
+    if (length < sizeof(heal_ranges_header_t))
+    {
+        return EINVAL;
+    }
+    count = ntoh32(header->count);
+    if (length != sizeof(heal_ranges_header_t) + sizeof(uint64_t) * 2 * count)
+    {
+        return EINVAL;
+    }
+    *generation = ntoh64(header->generation);
+
+    heal_ranges_clear(set);
+
+    ranges = (uint64_t *)(header + 1);
+    for (i = 0; i < count; i++)
+    {
+        start = ntoh64(*ranges++);
+        end = ntoh64(*ranges++);
+        error = heal_ranges_add(set, start, end);
+        if (error != 0)
+        {
+            heal_ranges_clear(set);
+
+            return error;
+        }
+    }
+
+    return 0;
+}
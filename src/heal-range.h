@@ -0,0 +1,61 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __HEAL_RANGE_H__
+#define __HEAL_RANGE_H__
+
+/* Maximum number of ranges kept in a set. When it's exceeded, the closest
+ * ranges are merged, so a set always covers at least all added ranges. */
+#define HEAL_RANGES_MAX 128
+
+typedef struct _heal_range
+{
+    uint64_t start;
+    uint64_t end;
+} heal_range_t;
+
+typedef struct _heal_ranges
+{
+    uint32_t count;
+    uint32_t size;
+    heal_range_t * ranges;
+} heal_ranges_t;
+
+/* Header of an encoded set of ranges. It's followed by 'count' pairs of
+ * 64 bits start and end offsets. All fields are stored in network byte
+ * order. */
+typedef struct _heal_ranges_header
+{
+    uint64_t generation;
+    uint32_t count;
+} __attribute__((__packed__)) heal_ranges_header_t;
+
+void heal_ranges_init(heal_ranges_t * set);
+void heal_ranges_clear(heal_ranges_t * set);
+int32_t heal_ranges_copy(heal_ranges_t * dst, heal_ranges_t * src);
+int32_t heal_ranges_contains(heal_ranges_t * set, uint64_t start, uint64_t end);
+int32_t heal_ranges_overlaps(heal_ranges_t * set, uint64_t start, uint64_t end);
+int32_t heal_ranges_touches(heal_ranges_t * set, uint64_t start, uint64_t end);
+void heal_ranges_trim(heal_ranges_t * set, uint64_t offset);
+int32_t heal_ranges_add(heal_ranges_t * set, uint64_t start, uint64_t end);
+int32_t heal_ranges_encode(heal_ranges_t * set, uint64_t generation, void ** data, uint32_t * length);
+int32_t heal_ranges_decode(heal_ranges_t * set, void * data, uint32_t length, uint64_t * generation);
+
+#endif /* __HEAL_RANGE_H__ */
@@ -0,0 +1,266 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+
+#include "byte-order.h"
+#include <xlator.h>
+#include <statedump.h>
+
+#include "heal.h"
+#include "heal-registry.h"
+
+static uint32_t heal_registry_hash(uuid_t gfid)
+{
+    uint32_t hash;
+    int32_t i;
+
+    // gfids are random, so a few bytes are enough to spread them.
+    hash = 0;
+    for (i = 12; i < 16; i++)
+    {
+        hash = (hash << 8) | gfid[i];
+    }
+
+    return hash % HEAL_REGISTRY_BUCKETS;
+}
+
+static gf_lock_t * heal_registry_lock(heal_registry_t * registry, uint32_t bucket)
+{
+    return &registry->locks[bucket % HEAL_REGISTRY_STRIPES];
+}
+
+static heal_registry_entry_t * __heal_registry_find(heal_registry_t * registry, uint32_t bucket, uuid_t gfid)
+{
+    heal_registry_entry_t * entry;
+
+    list_for_each_entry(entry, &registry->buckets[bucket], list)
+    {
+        if (uuid_compare(entry->gfid, gfid) == 0)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+void heal_registry_init(heal_registry_t * registry)
+{
+    int32_t i;
+
+    for (i = 0; i < HEAL_REGISTRY_STRIPES; i++)
+    {
+        LOCK_INIT(&registry->locks[i]);
+    }
+    for (i = 0; i < HEAL_REGISTRY_BUCKETS; i++)
+    {
+        INIT_LIST_HEAD(&registry->buckets[i]);
+    }
+    registry->count = 0;
+}
+
+void heal_registry_destroy(heal_registry_t * registry)
+{
+    heal_registry_entry_t * entry, * tmp;
+    int32_t i;
+
+    for (i = 0; i < HEAL_REGISTRY_BUCKETS; i++)
+    {
+        list_for_each_entry_safe(entry, tmp, &registry->buckets[i], list)
+        {
+            list_del(&entry->list);
+            GF_FREE(entry);
+        }
+    }
+    for (i = 0; i < HEAL_REGISTRY_STRIPES; i++)
+    {
+        LOCK_DESTROY(&registry->locks[i]);
+    }
+}
+
+/* Registers a heal that has just been started by the client that sent
+ * 'frame'. If the inode is already registered, its entry is reused. */
+int32_t heal_registry_add(heal_registry_t * registry, uuid_t gfid, uint64_t size, call_frame_t * frame)
+{
+    heal_registry_entry_t * entry, * tmp;
+    gf_lkowner_t * lk_owner;
+    uint32_t bucket;
+    int32_t length;
+
+    entry = GF_MALLOC(sizeof(heal_registry_entry_t), gf_heal_mt_heal_registry_entry_t);
+    if (entry == NULL)
+    {
+        return ENOMEM;
+    }
+    uuid_copy(entry->gfid, gfid);
+    entry->size = size;
+    entry->offset = 0;
+    entry->owner = 0;
+    lk_owner = &frame->root->lk_owner;
+    length = lk_owner->len;
+    if (length > sizeof(entry->owner))
+    {
+        length = sizeof(entry->owner);
+    }
+    if (length > 0)
+    {
+        memcpy(&entry->owner, lk_owner->data, length);
+    }
+    entry->pid = frame->root->pid;
+    entry->start = time(NULL);
+
+    bucket = heal_registry_hash(gfid);
+
+    LOCK(heal_registry_lock(registry, bucket));
+
+    tmp = __heal_registry_find(registry, bucket, gfid);
+    if (tmp != NULL)
+    {
+        list_del(&tmp->list);
+    }
+    else
+    {
+        __sync_fetch_and_add(&registry->count, 1);
+    }
+    list_add_tail(&entry->list, &registry->buckets[bucket]);
+
+    UNLOCK(heal_registry_lock(registry, bucket));
+
+    GF_FREE(tmp);
+
+    return 0;
+}
+
+void heal_registry_update(heal_registry_t * registry, uuid_t gfid, uint64_t size, uint64_t offset)
+{
+    heal_registry_entry_t * entry;
+    uint32_t bucket;
+
+    bucket = heal_registry_hash(gfid);
+
+    LOCK(heal_registry_lock(registry, bucket));
+
+    entry = __heal_registry_find(registry, bucket, gfid);
+    if (entry != NULL)
+    {
+        entry->size = size;
+        entry->offset = offset;
+    }
+
+    UNLOCK(heal_registry_lock(registry, bucket));
+}
+
+void heal_registry_del(heal_registry_t * registry, uuid_t gfid)
+{
+    heal_registry_entry_t * entry;
+    uint32_t bucket;
+
+    bucket = heal_registry_hash(gfid);
+
+    LOCK(heal_registry_lock(registry, bucket));
+
+    entry = __heal_registry_find(registry, bucket, gfid);
+    if (entry != NULL)
+    {
+        list_del(&entry->list);
+        __sync_fetch_and_sub(&registry->count, 1);
+    }
+
+    UNLOCK(heal_registry_lock(registry, bucket));
+
+    GF_FREE(entry);
+}
+
+/* Builds a page of at most HEAL_REGISTRY_PAGE entries starting at 'cursor'.
+ * The cursor contains the bucket in the upper 32 bits and the position
+ * inside the bucket in the lower 32 bits. Entries added or removed while
+ * the registry is being listed may be missed or returned twice. */
+int32_t heal_registry_list(heal_registry_t * registry, uint64_t cursor, void ** data, uint32_t * length)
+{
+    heal_registry_header_t * header;
+    heal_registry_record_t * record;
+    heal_registry_entry_t * entry;
+    uint32_t bucket, position, index, count;
+
+    header = GF_MALLOC(sizeof(heal_registry_header_t) + sizeof(heal_registry_record_t) * HEAL_REGISTRY_PAGE, gf_heal_mt_uint8_t);
+    if (header == NULL)
+    {
+        return ENOMEM;
+    }
+    record = (heal_registry_record_t *)(header + 1);
+
+    count = 0;
+    bucket = cursor >> 32;
+    position = cursor & 0xFFFFFFFF;
+    while ((bucket < HEAL_REGISTRY_BUCKETS) && (count < HEAL_REGISTRY_PAGE))
+    {
+        LOCK(heal_registry_lock(registry, bucket));
+
+        index = 0;
+        list_for_each_entry(entry, &registry->buckets[bucket], list)
+        {
+            if (index++ < position)
+            {
+                continue;
+            }
+            if (count >= HEAL_REGISTRY_PAGE)
+            {
+                break;
+            }
+            uuid_copy(record[count].gfid, entry->gfid);
+            record[count].size = hton64(entry->size);
+            record[count].offset = hton64(entry->offset);
+            record[count].owner = hton64(entry->owner);
+            record[count].pid = hton32(entry->pid);
+            record[count].start = hton64(entry->start);
+            count++;
+            position++;
+        }
+
+        UNLOCK(heal_registry_lock(registry, bucket));
+
+        if (count < HEAL_REGISTRY_PAGE)
+        {
+            bucket++;
+            position = 0;
+        }
+    }
+
+    // The first position of the first bucket is never a valid 'next'
+    // cursor, so 0 is used to mark the end of the list.
+    cursor = 0;
+    if (bucket < HEAL_REGISTRY_BUCKETS)
+    {
+        cursor = ((uint64_t)bucket << 32) | position;
+    }
+    header->next = hton64(cursor);
+    header->count = hton32(count);
+
+    *data = header;
+    *length = sizeof(heal_registry_header_t) + sizeof(heal_registry_record_t) * count;
+
+    return 0;
+}
+
+void heal_registry_dump(heal_registry_t * registry)
+{
+    gf_proc_dump_write("registry.active", "%lu", registry->count);
+}
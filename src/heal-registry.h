@@ -0,0 +1,73 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __HEAL_REGISTRY_H__
+#define __HEAL_REGISTRY_H__
+
+#define HEAL_REGISTRY_BUCKETS 1024
+#define HEAL_REGISTRY_STRIPES 32
+#define HEAL_REGISTRY_PAGE    256
+
+typedef struct _heal_registry_entry
+{
+    struct list_head list;
+    uuid_t gfid;
+    uint64_t size;
+    uint64_t offset;
+    uint64_t owner;
+    uint32_t pid;
+    uint64_t start;
+} heal_registry_entry_t;
+
+typedef struct _heal_registry
+{
+    gf_lock_t locks[HEAL_REGISTRY_STRIPES];
+    struct list_head buckets[HEAL_REGISTRY_BUCKETS];
+    uint64_t count;
+} heal_registry_t;
+
+/* Page returned by heal_registry_list(). 'count' records follow the
+ * header. All fields are in network byte order. A 'next' cursor of 0
+ * means that there are no more entries. */
+typedef struct _heal_registry_header
+{
+    uint64_t next;
+    uint32_t count;
+} __attribute__((__packed__)) heal_registry_header_t;
+
+typedef struct _heal_registry_record
+{
+    uuid_t gfid;
+    uint64_t size;
+    uint64_t offset;
+    uint64_t owner;
+    uint32_t pid;
+    uint64_t start;
+} __attribute__((__packed__)) heal_registry_record_t;
+
+void heal_registry_init(heal_registry_t * registry);
+void heal_registry_destroy(heal_registry_t * registry);
+int32_t heal_registry_add(heal_registry_t * registry, uuid_t gfid, uint64_t size, call_frame_t * frame);
+void heal_registry_update(heal_registry_t * registry, uuid_t gfid, uint64_t size, uint64_t offset);
+void heal_registry_del(heal_registry_t * registry, uuid_t gfid);
+int32_t heal_registry_list(heal_registry_t * registry, uint64_t cursor, void ** data, uint32_t * length);
+void heal_registry_dump(heal_registry_t * registry);
+
+#endif /* __HEAL_REGISTRY_H__ */
@@ -0,0 +1,542 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "byte-order.h"
+#include <xlator.h>
+#include <statedump.h>
+
+#include "heal.h"
+#include "heal-type-dict.h"
+#include "heal-scrub.h"
+
+#define HEAL_SCRUB_CHUNK_SIZE (128 * 1024)
+
+typedef struct _heal_scrub_entry
+{
+    struct list_head list;
+    inode_t * inode;
+    heal_map_t * map;
+    time_t queued;
+} heal_scrub_entry_t;
+
+typedef struct _heal_scrub_wait
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int32_t done;
+    int32_t result;
+    int32_t code;
+    uint32_t crc;
+    struct iatt attr;
+    dict_t * dict;
+} heal_scrub_wait_t;
+
+static void heal_scrub_wait_init(heal_scrub_wait_t * wait, uint32_t crc)
+{
+    pthread_mutex_init(&wait->lock, NULL);
+    pthread_cond_init(&wait->cond, NULL);
+    wait->done = 0;
+    wait->result = -1;
+    wait->code = EIO;
+    wait->crc = crc;
+    wait->dict = NULL;
+}
+
+static void heal_scrub_wait_done(heal_scrub_wait_t * wait, int32_t result, int32_t code)
+{
+    pthread_mutex_lock(&wait->lock);
+
+    wait->result = result;
+    wait->code = code;
+    wait->done = 1;
+    pthread_cond_signal(&wait->cond);
+
+    pthread_mutex_unlock(&wait->lock);
+}
+
+static void heal_scrub_wait_for(heal_scrub_wait_t * wait)
+{
+    pthread_mutex_lock(&wait->lock);
+
+    while (!wait->done)
+    {
+        pthread_cond_wait(&wait->cond, &wait->lock);
+    }
+
+    pthread_mutex_unlock(&wait->lock);
+
+    pthread_cond_destroy(&wait->cond);
+    pthread_mutex_destroy(&wait->lock);
+}
+
+int32_t heal_scrub_readv_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iovec * vector, int32_t count, struct iatt * attr, struct iobref * iobref, dict_t * xdata)
+{
+    heal_scrub_wait_t * wait;
+    int32_t i;
+
+    wait = cookie;
+    if (result >= 0)
+    {
+        for (i = 0; i < count; i++)
+        {
+            wait->crc = heal_crc32c(wait->crc, vector[i].iov_base, vector[i].iov_len);
+        }
+        wait->attr = *attr;
+    }
+
+    heal_scrub_wait_done(wait, result, code);
+
+    STACK_DESTROY(frame->root);
+
+    return 0;
+}
+
+int32_t heal_scrub_fgetxattr_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * dict, dict_t * xdata)
+{
+    heal_scrub_wait_t * wait;
+
+    wait = cookie;
+    if ((result >= 0) && (dict != NULL))
+    {
+        wait->dict = dict_ref(dict);
+    }
+
+    heal_scrub_wait_done(wait, result, code);
+
+    STACK_DESTROY(frame->root);
+
+    return 0;
+}
+
+int32_t heal_scrub_fsetxattr_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    heal_scrub_wait_done(cookie, result, code);
+
+    STACK_DESTROY(frame->root);
+
+    return 0;
+}
+
+/* Reads 'size' bytes at 'offset' and returns the checksum of the data. The
+ * block is read in chunks to avoid allocating big buffers when the block
+ * size has been increased for big files. */
+static int32_t heal_scrub_block(heal_scrub_t * scrub, fd_t * fd, heal_map_t * map, uint64_t offset, uint64_t size, uint32_t * crc)
+{
+    heal_scrub_wait_t wait;
+    call_frame_t * frame;
+    uint32_t chunk;
+
+    *crc = 0;
+    while (size > 0)
+    {
+        chunk = HEAL_SCRUB_CHUNK_SIZE;
+        if (chunk > size)
+        {
+            chunk = size;
+        }
+
+        frame = create_frame(scrub->xl, scrub->xl->ctx->pool);
+        if (frame == NULL)
+        {
+            return ENOMEM;
+        }
+
+        heal_scrub_wait_init(&wait, *crc);
+
+        STACK_WIND_COOKIE(frame, heal_scrub_readv_cbk, &wait, FIRST_CHILD(scrub->xl), FIRST_CHILD(scrub->xl)->fops->readv, fd, chunk, offset, 0, NULL);
+
+        heal_scrub_wait_for(&wait);
+
+        if (wait.result < 0)
+        {
+            return wait.code;
+        }
+        // If the data has been modified after the heal, the map is not
+        // valid anymore. Times can't be used because the metadata heal sets
+        // them after the data has been healed.
+        if ((wait.result != chunk) ||
+            (wait.attr.ia_size != map->size) ||
+            (heal_data_version(scrub->xl, fd->inode) != map->version))
+        {
+            return ESTALE;
+        }
+
+        *crc = wait.crc;
+        offset += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+/* Reads the map stored in the file, so that the persisted copy is the one
+ * verified. */
+static int32_t heal_scrub_load(heal_scrub_t * scrub, fd_t * fd, heal_map_t ** map)
+{
+    heal_scrub_wait_t wait;
+    call_frame_t * frame;
+    data_t * data;
+
+    *map = NULL;
+
+    frame = create_frame(scrub->xl, scrub->xl->ctx->pool);
+    if (frame == NULL)
+    {
+        return ENOMEM;
+    }
+
+    heal_scrub_wait_init(&wait, 0);
+
+    STACK_WIND_COOKIE(frame, heal_scrub_fgetxattr_cbk, &wait, FIRST_CHILD(scrub->xl), FIRST_CHILD(scrub->xl)->fops->fgetxattr, fd, HEAL_KEY_MAP, NULL);
+
+    heal_scrub_wait_for(&wait);
+
+    if (wait.result < 0)
+    {
+        return wait.code;
+    }
+
+    data = (wait.dict != NULL) ? dict_get(wait.dict, HEAL_KEY_MAP) : NULL;
+    if (data != NULL)
+    {
+        *map = heal_map_decode(data->data, data->len);
+    }
+    if (wait.dict != NULL)
+    {
+        dict_unref(wait.dict);
+    }
+
+    return (*map != NULL) ? 0 : EINVAL;
+}
+
+static void heal_scrub_mark(heal_scrub_t * scrub, fd_t * fd, uint32_t bad)
+{
+    heal_scrub_wait_t wait;
+    call_frame_t * frame;
+    dict_t * dict;
+
+    dict = dict_new();
+    if (dict == NULL)
+    {
+        return;
+    }
+    if (heal_dict_set_uint32_cow(&dict, HEAL_KEY_SCRUB, bad) == 0)
+    {
+        frame = create_frame(scrub->xl, scrub->xl->ctx->pool);
+        if (frame != NULL)
+        {
+            heal_scrub_wait_init(&wait, 0);
+
+            STACK_WIND_COOKIE(frame, heal_scrub_fsetxattr_cbk, &wait, FIRST_CHILD(scrub->xl), FIRST_CHILD(scrub->xl)->fops->fsetxattr, fd, dict, 0, NULL);
+
+            heal_scrub_wait_for(&wait);
+        }
+    }
+    dict_unref(dict);
+}
+
+static void heal_scrub_verify(heal_scrub_t * scrub, heal_scrub_entry_t * entry)
+{
+    heal_map_t * map, * stored;
+    fd_t * fd;
+    uint64_t offset, size;
+    uint32_t i, crc, bad;
+    int32_t error;
+
+    map = entry->map;
+
+    fd = fd_anonymous(entry->inode);
+    if (fd == NULL)
+    {
+        return;
+    }
+
+    error = heal_scrub_load(scrub, fd, &stored);
+    if (error != 0)
+    {
+        gf_log(scrub->xl->name, GF_LOG_WARNING, "Unable to read the integrity map of healed file %s (error=%d)", uuid_utoa(entry->inode->gfid), error);
+
+        fd_unref(fd);
+
+        return;
+    }
+    if ((stored->size != map->size) || (stored->block_size != map->block_size) || (stored->count != map->count))
+    {
+        gf_log(scrub->xl->name, GF_LOG_ERROR, "The stored integrity map of healed file %s is not valid", uuid_utoa(entry->inode->gfid));
+
+        heal_map_destroy(stored);
+        heal_scrub_mark(scrub, fd, map->count);
+        fd_unref(fd);
+
+        return;
+    }
+
+    error = 0;
+    bad = 0;
+    offset = 0;
+    for (i = 0; (i < map->count) && scrub->running; i++)
+    {
+        size = map->block_size;
+        if (offset + size > map->size)
+        {
+            size = map->size - offset;
+        }
+
+        error = heal_scrub_block(scrub, fd, map, offset, size, &crc);
+        if (error != 0)
+        {
+            break;
+        }
+        if (crc != stored->blocks[i])
+        {
+            gf_log(scrub->xl->name, GF_LOG_ERROR, "Checksum mismatch in block %u of healed file %s", i, uuid_utoa(entry->inode->gfid));
+
+            bad++;
+        }
+
+        offset += size;
+
+        if (scrub->delay > 0)
+        {
+            usleep(scrub->delay * 1000);
+        }
+    }
+
+    pthread_mutex_lock(&scrub->lock);
+
+    if (error == ESTALE)
+    {
+        scrub->stale++;
+    }
+    else if ((error == 0) && (i == map->count))
+    {
+        scrub->verified++;
+        if (bad != 0)
+        {
+            scrub->mismatches++;
+        }
+    }
+
+    pthread_mutex_unlock(&scrub->lock);
+
+    heal_map_destroy(stored);
+
+    if (bad != 0)
+    {
+        heal_scrub_mark(scrub, fd, bad);
+    }
+    else if ((error != 0) && (error != ESTALE))
+    {
+        gf_log(scrub->xl->name, GF_LOG_WARNING, "Unable to verify healed file %s (error=%d)", uuid_utoa(entry->inode->gfid), error);
+    }
+
+    fd_unref(fd);
+}
+
+static void heal_scrub_entry_destroy(heal_scrub_entry_t * entry)
+{
+    inode_unref(entry->inode);
+    heal_map_destroy(entry->map);
+    GF_FREE(entry);
+}
+
+static void * heal_scrub_thread(void * data)
+{
+    heal_scrub_entry_t * entry;
+    heal_scrub_t * scrub;
+    struct timespec deadline;
+
+    scrub = data;
+
+    THIS = scrub->xl;
+
+#ifdef GF_LINUX_HOST_OS
+    // The scrubber must not compete with normal requests.
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+
+    pthread_mutex_lock(&scrub->lock);
+
+    while (scrub->running)
+    {
+        if (list_empty(&scrub->queue))
+        {
+            pthread_cond_wait(&scrub->cond, &scrub->lock);
+
+            continue;
+        }
+
+        // Files are verified once their data has probably been evicted
+        // from the page cache, so that what is on disk is read.
+        entry = list_entry(scrub->queue.next, heal_scrub_entry_t, list);
+        if (entry->queued + scrub->min_age > time(NULL))
+        {
+            deadline.tv_sec = entry->queued + scrub->min_age;
+            deadline.tv_nsec = 0;
+            pthread_cond_timedwait(&scrub->cond, &scrub->lock, &deadline);
+
+            continue;
+        }
+        list_del_init(&entry->list);
+        scrub->pending--;
+
+        pthread_mutex_unlock(&scrub->lock);
+
+        heal_scrub_verify(scrub, entry);
+        heal_scrub_entry_destroy(entry);
+
+        pthread_mutex_lock(&scrub->lock);
+    }
+
+    pthread_mutex_unlock(&scrub->lock);
+
+    return NULL;
+}
+
+int32_t heal_scrub_start(xlator_t * xl, heal_scrub_t * scrub, uint32_t delay, uint32_t min_age)
+{
+    int32_t error;
+
+    scrub->xl = xl;
+    scrub->delay = delay;
+    scrub->min_age = min_age;
+    scrub->running = 1;
+    scrub->pending = 0;
+    scrub->queued = 0;
+    scrub->dropped = 0;
+    scrub->verified = 0;
+    scrub->mismatches = 0;
+    scrub->stale = 0;
+    INIT_LIST_HEAD(&scrub->queue);
+    pthread_mutex_init(&scrub->lock, NULL);
+    pthread_cond_init(&scrub->cond, NULL);
+
+    error = pthread_create(&scrub->thread, NULL, heal_scrub_thread, scrub);
+    if (error != 0)
+    {
+        gf_log(xl->name, GF_LOG_ERROR, "Unable to start the scrubber thread (error=%d)", error);
+
+        scrub->running = 0;
+        scrub->xl = NULL;
+        pthread_cond_destroy(&scrub->cond);
+        pthread_mutex_destroy(&scrub->lock);
+    }
+
+    return error;
+}
+
+void heal_scrub_stop(heal_scrub_t * scrub)
+{
+    heal_scrub_entry_t * entry, * tmp;
+
+    if (!scrub->running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&scrub->lock);
+
+    scrub->running = 0;
+    pthread_cond_signal(&scrub->cond);
+
+    pthread_mutex_unlock(&scrub->lock);
+
+    pthread_join(scrub->thread, NULL);
+
+    scrub->xl = NULL;
+
+    list_for_each_entry_safe(entry, tmp, &scrub->queue, list)
+    {
+        list_del_init(&entry->list);
+        heal_scrub_entry_destroy(entry);
+    }
+
+    pthread_cond_destroy(&scrub->cond);
+    pthread_mutex_destroy(&scrub->lock);
+}
+
+/* Adds a healed file to the queue of files to verify. The map is owned by
+ * the scrubber after this call. */
+void heal_scrub_queue(heal_scrub_t * scrub, inode_t * inode, heal_map_t * map)
+{
+    heal_scrub_entry_t * entry;
+
+    if (!scrub->running)
+    {
+        heal_map_destroy(map);
+
+        return;
+    }
+
+    entry = GF_MALLOC(sizeof(heal_scrub_entry_t), gf_heal_mt_heal_scrub_entry_t);
+    if (entry == NULL)
+    {
+        heal_map_destroy(map);
+
+        return;
+    }
+    entry->map = map;
+    entry->queued = time(NULL);
+
+    pthread_mutex_lock(&scrub->lock);
+
+    if (scrub->pending >= HEAL_SCRUB_QUEUE_MAX)
+    {
+        scrub->dropped++;
+
+        pthread_mutex_unlock(&scrub->lock);
+
+        heal_map_destroy(map);
+        GF_FREE(entry);
+
+        return;
+    }
+
+    entry->inode = inode_ref(inode);
+    list_add_tail(&entry->list, &scrub->queue);
+    scrub->pending++;
+    scrub->queued++;
+    pthread_cond_signal(&scrub->cond);
+
+    pthread_mutex_unlock(&scrub->lock);
+}
+
+void heal_scrub_dump(heal_scrub_t * scrub)
+{
+    if (scrub->xl == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&scrub->lock);
+
+    gf_proc_dump_write("scrub.running", "%d", scrub->running);
+    gf_proc_dump_write("scrub.pending", "%u", scrub->pending);
+    gf_proc_dump_write("scrub.queued", "%lu", scrub->queued);
+    gf_proc_dump_write("scrub.dropped", "%lu", scrub->dropped);
+    gf_proc_dump_write("scrub.verified", "%lu", scrub->verified);
+    gf_proc_dump_write("scrub.mismatches", "%lu", scrub->mismatches);
+    gf_proc_dump_write("scrub.stale", "%lu", scrub->stale);
+
+    pthread_mutex_unlock(&scrub->lock);
+}
@@ -0,0 +1,56 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __HEAL_SCRUB_H__
+#define __HEAL_SCRUB_H__
+
+#include <pthread.h>
+
+#include "heal-map.h"
+
+/* Maximum number of files waiting to be verified. Each one keeps its inode
+ * and map in memory, so files healed while the queue is full are not
+ * verified. */
+#define HEAL_SCRUB_QUEUE_MAX 4096
+
+typedef struct _heal_scrub
+{
+    xlator_t * xl;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head queue;
+    int32_t running;
+    uint32_t delay;
+    uint32_t min_age;
+    uint32_t pending;
+    uint64_t queued;
+    uint64_t dropped;
+    uint64_t verified;
+    uint64_t mismatches;
+    uint64_t stale;
+} heal_scrub_t;
+
+int32_t heal_scrub_start(xlator_t * xl, heal_scrub_t * scrub, uint32_t delay, uint32_t min_age);
+void heal_scrub_stop(heal_scrub_t * scrub);
+void heal_scrub_queue(heal_scrub_t * scrub, inode_t * inode, heal_map_t * map);
+void heal_scrub_dump(heal_scrub_t * scrub);
+
+#endif /* __HEAL_SCRUB_H__ */
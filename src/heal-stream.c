@@ -0,0 +1,383 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#include <xlator.h>
+#include <call-stub.h>
+
+#include "heal.h"
+#include "heal-stream.h"
+
+heal_stream_t * heal_stream_new(fd_t * fd)
+{
+    heal_stream_t * stream;
+
+    stream = GF_MALLOC(sizeof(heal_stream_t), gf_heal_mt_heal_stream_t);
+    if (stream == NULL)
+    {
+        return NULL;
+    }
+
+    LOCK_INIT(&stream->lock);
+    stream->fd = fd;
+    INIT_LIST_HEAD(&stream->blocks);
+    INIT_LIST_HEAD(&stream->waiters);
+    stream->next = 0;
+    stream->ahead = 0;
+    stream->eof = UINT64_MAX;
+    stream->version = 0;
+
+    return stream;
+}
+
+static void heal_stream_block_free(heal_stream_block_t * block)
+{
+    if (block->iobref != NULL)
+    {
+        iobref_unref(block->iobref);
+    }
+    GF_FREE(block->vector);
+    GF_FREE(block);
+}
+
+/* Removes a block from the stream. Blocks still being read are only
+ * marked, and they are released when the read completes. */
+static void __heal_stream_block_drop(heal_stream_block_t * block)
+{
+    list_del_init(&block->list);
+    if (block->state == HEAL_STREAM_PENDING)
+    {
+        block->stale = 1;
+    }
+    else
+    {
+        heal_stream_block_free(block);
+    }
+}
+
+void heal_stream_destroy(heal_stream_t * stream)
+{
+    heal_stream_block_t * block, * tmp;
+
+    // Pending reads hold a reference to the fd, so all blocks are complete
+    // when the fd is released.
+    list_for_each_entry_safe(block, tmp, &stream->blocks, list)
+    {
+        list_del_init(&block->list);
+        heal_stream_block_free(block);
+    }
+
+    LOCK_DESTROY(&stream->lock);
+    GF_FREE(stream);
+}
+
+static heal_stream_block_t * __heal_stream_find(heal_stream_t * stream, uint64_t offset)
+{
+    heal_stream_block_t * block;
+
+    list_for_each_entry(block, &stream->blocks, list)
+    {
+        if ((block->offset <= offset) && (offset < block->offset + block->size))
+        {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+static void __heal_stream_seek(heal_stream_t * stream, uint64_t offset)
+{
+    heal_stream_block_t * block, * tmp;
+
+    list_for_each_entry_safe(block, tmp, &stream->blocks, list)
+    {
+        __heal_stream_block_drop(block);
+    }
+
+    stream->next = offset;
+    stream->ahead = offset;
+    stream->eof = UINT64_MAX;
+}
+
+static int32_t __heal_stream_issue(heal_stream_t * stream, uint64_t end, uint64_t block_size, struct list_head * issue)
+{
+    heal_stream_block_t * block;
+
+    while ((stream->ahead < end) && (stream->ahead < stream->eof))
+    {
+        block = GF_CALLOC(1, sizeof(heal_stream_block_t), gf_heal_mt_heal_stream_block_t);
+        if (block == NULL)
+        {
+            return ENOMEM;
+        }
+
+        block->stream = stream;
+        block->offset = stream->ahead;
+        block->size = block_size;
+        block->state = HEAL_STREAM_PENDING;
+        list_add_tail(&block->list, &stream->blocks);
+        list_add_tail(&block->issue, issue);
+
+        stream->ahead += block_size;
+    }
+
+    return 0;
+}
+
+/* Appends to 'vector' the part of the data of 'block' between the file
+ * offsets 'start' and 'end'. Returns the number of elements added. */
+static int32_t heal_stream_slice(heal_stream_block_t * block, uint64_t start, uint64_t end, struct iovec * vector)
+{
+    uint64_t pos, len;
+    int32_t i, count;
+
+    count = 0;
+    pos = block->offset;
+    for (i = 0; (i < block->count) && (pos < end); i++)
+    {
+        len = block->vector[i].iov_len;
+        if (pos + len > start)
+        {
+            vector[count].iov_base = block->vector[i].iov_base;
+            vector[count].iov_len = len;
+            if (pos < start)
+            {
+                vector[count].iov_base = (char *)vector[count].iov_base + (start - pos);
+                vector[count].iov_len -= start - pos;
+            }
+            if (pos + len > end)
+            {
+                vector[count].iov_len -= pos + len - end;
+            }
+            count++;
+        }
+        pos += len;
+    }
+
+    return count;
+}
+
+/* Serves a sequential read of the heal source and requests to the brick
+ * the blocks needed to keep 'window' bytes read in advance. Blocks to read
+ * are added to 'issue'. If some of the requested data is not available
+ * yet, 'stub' is queued and EINPROGRESS is returned. It must be resumed
+ * once any block completes. 'version' is the current data version of the
+ * inode. */
+int32_t heal_stream_read(heal_stream_t * stream, uint64_t version, uint64_t offset, uint64_t size, uint64_t window, uint64_t block_size, call_stub_t * stub, struct list_head * issue, heal_stream_reply_t * reply)
+{
+    heal_stream_block_t * block, * tmp;
+    uint64_t end, pos, stop;
+    int32_t error, count;
+
+    end = offset + size;
+    reply->vector = NULL;
+    reply->count = 0;
+    reply->iobref = NULL;
+    memset(&reply->attr, 0, sizeof(reply->attr));
+
+    LOCK(&stream->lock);
+
+    // A client has modified the file since the blocks were requested, so
+    // they may contain old data.
+    if (version != stream->version)
+    {
+        __heal_stream_seek(stream, offset);
+        stream->version = version;
+    }
+    else if ((offset != stream->next) && (__heal_stream_find(stream, offset) == NULL))
+    {
+        __heal_stream_seek(stream, offset);
+    }
+
+    // Data before the requested offset won't be read again.
+    list_for_each_entry_safe(block, tmp, &stream->blocks, list)
+    {
+        if (block->offset + block->size > offset)
+        {
+            break;
+        }
+        __heal_stream_block_drop(block);
+    }
+
+    // An allocation failure only reduces the readahead. It's detected below
+    // if the requested data is not covered.
+    __heal_stream_issue(stream, end + window, block_size, issue);
+
+    count = 0;
+    pos = offset;
+    error = 0;
+    list_for_each_entry_safe(block, tmp, &stream->blocks, list)
+    {
+        if ((pos >= end) || (block->offset > pos))
+        {
+            break;
+        }
+        if (block->state == HEAL_STREAM_PENDING)
+        {
+            if (stub != NULL)
+            {
+                list_add_tail(&stub->list, &stream->waiters);
+            }
+            error = EINPROGRESS;
+
+            goto done;
+        }
+        if (block->state == HEAL_STREAM_FAILED)
+        {
+            // The block is read again on the next request.
+            error = block->error;
+            __heal_stream_seek(stream, block->offset);
+
+            goto done;
+        }
+        count += block->count;
+        stop = block->offset + block->length;
+        if (stop > end)
+        {
+            stop = end;
+        }
+        if (stop > pos)
+        {
+            pos = stop;
+        }
+        reply->attr = block->attr;
+        if (block->length < block->size)
+        {
+            break;
+        }
+    }
+
+    if ((pos < end) && (pos < stream->eof))
+    {
+        error = ENOMEM;
+
+        goto done;
+    }
+
+    if (count > 0)
+    {
+        reply->vector = GF_MALLOC(sizeof(struct iovec) * count, gf_heal_mt_iovec_t);
+        reply->iobref = iobref_new();
+        if ((reply->vector == NULL) || (reply->iobref == NULL))
+        {
+            error = ENOMEM;
+
+            goto done;
+        }
+
+        list_for_each_entry(block, &stream->blocks, list)
+        {
+            if (block->offset + block->size <= offset)
+            {
+                continue;
+            }
+            if (block->offset >= pos)
+            {
+                break;
+            }
+            reply->count += heal_stream_slice(block, offset, pos, reply->vector + reply->count);
+            if ((block->iobref != NULL) && (iobref_merge(reply->iobref, block->iobref) != 0))
+            {
+                error = ENOMEM;
+
+                goto done;
+            }
+        }
+    }
+
+    stream->next = pos;
+
+done:
+    UNLOCK(&stream->lock);
+
+    if ((error != 0) && (error != EINPROGRESS))
+    {
+        heal_stream_reply_release(reply);
+    }
+
+    return error;
+}
+
+/* Stores the result of the read of a block. The requests waiting for data
+ * are moved to 'waiters' so that they can be resumed. */
+void heal_stream_complete(heal_stream_block_t * block, int32_t result, int32_t error, struct iovec * vector, int32_t count, struct iobref * iobref, struct iatt * attr, struct list_head * waiters)
+{
+    heal_stream_t * stream;
+    int32_t stale;
+
+    stream = block->stream;
+
+    LOCK(&stream->lock);
+
+    stale = block->stale;
+    if (!stale)
+    {
+        if ((error == 0) && (result >= 0))
+        {
+            block->vector = GF_MALLOC(sizeof(struct iovec) * count, gf_heal_mt_iovec_t);
+            if (block->vector == NULL)
+            {
+                error = ENOMEM;
+            }
+        }
+        if ((error == 0) && (result >= 0))
+        {
+            memcpy(block->vector, vector, sizeof(struct iovec) * count);
+            block->count = count;
+            block->iobref = iobref_ref(iobref);
+            block->length = result;
+            block->attr = *attr;
+            block->state = HEAL_STREAM_READY;
+
+            if ((block->length < block->size) && (block->offset + block->length < stream->eof))
+            {
+                stream->eof = block->offset + block->length;
+            }
+        }
+        else
+        {
+            block->error = (error != 0) ? error : EIO;
+            block->state = HEAL_STREAM_FAILED;
+        }
+
+    }
+
+    // Requests waiting for a dropped block need to request it again.
+    list_splice_init(&stream->waiters, waiters);
+
+    UNLOCK(&stream->lock);
+
+    if (stale)
+    {
+        heal_stream_block_free(block);
+    }
+}
+
+void heal_stream_reply_release(heal_stream_reply_t * reply)
+{
+    if (reply->iobref != NULL)
+    {
+        iobref_unref(reply->iobref);
+        reply->iobref = NULL;
+    }
+    GF_FREE(reply->vector);
+    reply->vector = NULL;
+    reply->count = 0;
+}
@@ -0,0 +1,82 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __HEAL_STREAM_H__
+#define __HEAL_STREAM_H__
+
+#define HEAL_STREAM_PENDING 0
+#define HEAL_STREAM_READY   1
+#define HEAL_STREAM_FAILED  2
+
+struct _heal_stream;
+
+/* Block read in advance from the heal source. Once it is ready, its data
+ * is never modified, so it can be used without holding the lock as long
+ * as a reference to its iobref is kept. */
+typedef struct _heal_stream_block
+{
+    struct list_head list;
+    struct list_head issue;
+    struct _heal_stream * stream;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t length;
+    int32_t state;
+    int32_t error;
+    int32_t stale;
+    struct iovec * vector;
+    int32_t count;
+    struct iobref * iobref;
+    struct iatt attr;
+} heal_stream_block_t;
+
+/* Sequential reader of the heal source attached to an fd. 'next' is the
+ * offset where the next sequential read is expected and 'ahead' the end of
+ * the data already requested to the brick. 'version' is the data version of
+ * the inode when the current blocks were requested. */
+typedef struct _heal_stream
+{
+    gf_lock_t lock;
+    fd_t * fd;
+    struct list_head blocks;
+    struct list_head waiters;
+    uint64_t next;
+    uint64_t ahead;
+    uint64_t eof;
+    uint64_t version;
+} heal_stream_t;
+
+/* Data returned by heal_stream_read(). It has its own references to the
+ * buffers of the blocks. */
+typedef struct _heal_stream_reply
+{
+    struct iovec * vector;
+    int32_t count;
+    struct iobref * iobref;
+    struct iatt attr;
+} heal_stream_reply_t;
+
+heal_stream_t * heal_stream_new(fd_t * fd);
+void heal_stream_destroy(heal_stream_t * stream);
+int32_t heal_stream_read(heal_stream_t * stream, uint64_t version, uint64_t offset, uint64_t size, uint64_t window, uint64_t block_size, call_stub_t * stub, struct list_head * issue, heal_stream_reply_t * reply);
+void heal_stream_complete(heal_stream_block_t * block, int32_t result, int32_t error, struct iovec * vector, int32_t count, struct iobref * iobref, struct iatt * attr, struct list_head * waiters);
+void heal_stream_reply_release(heal_stream_reply_t * reply);
+
+#endif /* __HEAL_STREAM_H__ */
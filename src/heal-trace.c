@@ -0,0 +1,340 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "byte-order.h"
+#include <xlator.h>
+#include <statedump.h>
+
+#include "heal.h"
+#include "heal-trace.h"
+
+/* Rings are only freed when the last instance of the translator is
+ * destroyed, so readers can walk the list without holding the lock once
+ * they have read its head. Rings of a previous generation are never used
+ * again by their threads. Rings of exited threads are reused, so the list
+ * only grows with the number of threads alive at the same time. */
+static heal_trace_ring_t * heal_trace_rings = NULL;
+static pthread_mutex_t heal_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t heal_trace_users = 0;
+static uint64_t heal_trace_generation = 1;
+static __thread heal_trace_ring_t * heal_trace_ring = NULL;
+static __thread uint64_t heal_trace_ring_generation = 0;
+static pthread_key_t heal_trace_key;
+static pthread_once_t heal_trace_once = PTHREAD_ONCE_INIT;
+
+static const char * heal_trace_names[] =
+{
+    [HEAL_TRACE_START]    = "start",
+    [HEAL_TRACE_PROGRESS] = "progress",
+    [HEAL_TRACE_REJECT]   = "reject",
+    [HEAL_TRACE_TRUNCATE] = "truncate",
+    [HEAL_TRACE_RELEASE]  = "release",
+    [HEAL_TRACE_ABORT]    = "abort",
+    [HEAL_TRACE_TAKEOVER] = "takeover",
+    [HEAL_TRACE_COMMIT]   = "commit"
+};
+
+/* Called when a thread that has recorded events exits. The ring may have
+ * been freed already if the translator has been destroyed, and its memory
+ * reused by the ring of another thread, so the owner is checked too. */
+static void heal_trace_ring_release(void * data)
+{
+    heal_trace_ring_t * ring;
+    pid_t tid;
+
+    tid = syscall(SYS_gettid);
+
+    pthread_mutex_lock(&heal_trace_lock);
+
+    for (ring = heal_trace_rings; ring != NULL; ring = ring->next)
+    {
+        if ((ring == data) && (ring->tid == tid))
+        {
+            ring->free = 1;
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&heal_trace_lock);
+}
+
+static void heal_trace_key_create(void)
+{
+    pthread_key_create(&heal_trace_key, heal_trace_ring_release);
+}
+
+/* Takes the ring of a thread that has exited. Its events are discarded:
+ * readers skip events with a sequence of 0. */
+static void __heal_trace_ring_reuse(heal_trace_ring_t * ring)
+{
+    uint32_t i;
+
+    ring->free = 0;
+    __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+    for (i = 0; i < HEAL_TRACE_EVENTS; i++)
+    {
+        __atomic_store_n(&ring->events[i].seq, 0, __ATOMIC_RELEASE);
+    }
+    ring->tid = syscall(SYS_gettid);
+}
+
+static heal_trace_ring_t * heal_trace_ring_get(void)
+{
+    heal_trace_ring_t * ring;
+
+    ring = heal_trace_ring;
+    if ((ring != NULL) && (heal_trace_ring_generation == __atomic_load_n(&heal_trace_generation, __ATOMIC_ACQUIRE)))
+    {
+        return ring;
+    }
+
+    pthread_mutex_lock(&heal_trace_lock);
+
+    for (ring = heal_trace_rings; ring != NULL; ring = ring->next)
+    {
+        if (ring->free)
+        {
+            __heal_trace_ring_reuse(ring);
+            heal_trace_ring_generation = heal_trace_generation;
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&heal_trace_lock);
+
+    if (ring == NULL)
+    {
+        ring = GF_CALLOC(1, sizeof(heal_trace_ring_t), gf_heal_mt_heal_trace_ring_t);
+        if (ring == NULL)
+        {
+            return NULL;
+        }
+        ring->tid = syscall(SYS_gettid);
+
+        pthread_mutex_lock(&heal_trace_lock);
+
+        ring->next = heal_trace_rings;
+        __atomic_store_n(&heal_trace_rings, ring, __ATOMIC_RELEASE);
+        heal_trace_ring_generation = heal_trace_generation;
+
+        pthread_mutex_unlock(&heal_trace_lock);
+    }
+
+    heal_trace_ring = ring;
+    pthread_setspecific(heal_trace_key, ring);
+
+    return ring;
+}
+
+/* Records an event in the ring of the current thread. Older events are
+ * overwritten when the ring is full. */
+void heal_trace(uint32_t type, uuid_t gfid, uint64_t arg1, uint64_t arg2)
+{
+    heal_trace_ring_t * ring;
+    heal_trace_event_t * event;
+    struct timespec now;
+    uint64_t head;
+
+    ring = heal_trace_ring_get();
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    head = ring->head;
+    event = &ring->events[head % HEAL_TRACE_EVENTS];
+
+    // A sequence of 0 marks the event as being modified.
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    event->type = type;
+    uuid_copy(event->gfid, gfid);
+    event->arg1 = arg1;
+    event->arg2 = arg2;
+    __atomic_store_n(&event->seq, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies an event of a ring. Returns 0 if it has been overwritten while it
+ * was being read. */
+static int32_t heal_trace_read(heal_trace_event_t * event, heal_trace_event_t * copy)
+{
+    uint64_t seq;
+
+    seq = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0)
+    {
+        return 0;
+    }
+    copy->time = event->time;
+    copy->type = event->type;
+    uuid_copy(copy->gfid, event->gfid);
+    copy->arg1 = event->arg1;
+    copy->arg2 = event->arg2;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == seq;
+}
+
+typedef int32_t (* heal_trace_walk_f)(heal_trace_ring_t * ring, heal_trace_event_t * event, void * data);
+
+static int32_t heal_trace_walk(heal_trace_walk_f walk, void * data)
+{
+    heal_trace_ring_t * ring;
+    heal_trace_event_t event;
+    uint64_t head, i;
+    int32_t error;
+
+    for (ring = __atomic_load_n(&heal_trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        i = (head > HEAL_TRACE_EVENTS) ? head - HEAL_TRACE_EVENTS : 0;
+        for (; i < head; i++)
+        {
+            if (heal_trace_read(&ring->events[i % HEAL_TRACE_EVENTS], &event))
+            {
+                error = walk(ring, &event, data);
+                if (error != 0)
+                {
+                    return error;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+typedef struct _heal_trace_buffer
+{
+    heal_trace_record_t * records;
+    uint32_t count;
+    uint32_t size;
+} heal_trace_buffer_t;
+
+static int32_t heal_trace_collect_event(heal_trace_ring_t * ring, heal_trace_event_t * event, void * data)
+{
+    heal_trace_buffer_t * buffer;
+    heal_trace_record_t * record;
+
+    buffer = data;
+    // Rings may have been added since the buffer was allocated.
+    if (buffer->count >= buffer->size)
+    {
+        return ENOBUFS;
+    }
+
+    record = &buffer->records[buffer->count++];
+    record->time = hton64(event->time);
+    record->tid = hton32(ring->tid);
+    record->type = hton32(event->type);
+    uuid_copy(record->gfid, event->gfid);
+    record->arg1 = hton64(event->arg1);
+    record->arg2 = hton64(event->arg2);
+
+    return 0;
+}
+
+/* Returns all events currently stored in the rings, unordered. */
+int32_t heal_trace_collect(void ** data, uint32_t * length)
+{
+    heal_trace_buffer_t buffer;
+    heal_trace_ring_t * ring;
+
+    buffer.size = 0;
+    for (ring = __atomic_load_n(&heal_trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        buffer.size += HEAL_TRACE_EVENTS;
+    }
+    buffer.count = 0;
+    buffer.records = GF_MALLOC(sizeof(heal_trace_record_t) * buffer.size + 1, gf_heal_mt_uint8_t);
+    if (buffer.records == NULL)
+    {
+        return ENOMEM;
+    }
+
+    heal_trace_walk(heal_trace_collect_event, &buffer);
+
+    *data = buffer.records;
+    *length = sizeof(heal_trace_record_t) * buffer.count;
+
+    return 0;
+}
+
+static int32_t heal_trace_dump_event(heal_trace_ring_t * ring, heal_trace_event_t * event, void * data)
+{
+    char key[64];
+    uint32_t * index;
+
+    index = data;
+    snprintf(key, sizeof(key), "trace.%u", (*index)++);
+    gf_proc_dump_write(key, "%lu.%09lu %d %s %s %lu %lu", event->time / 1000000000, event->time % 1000000000, ring->tid, heal_trace_names[event->type], uuid_utoa(event->gfid), event->arg1, event->arg2);
+
+    return 0;
+}
+
+void heal_trace_dump(void)
+{
+    uint32_t index;
+
+    index = 0;
+    heal_trace_walk(heal_trace_dump_event, &index);
+}
+
+void heal_trace_init(void)
+{
+    pthread_once(&heal_trace_once, heal_trace_key_create);
+
+    pthread_mutex_lock(&heal_trace_lock);
+
+    heal_trace_users++;
+
+    pthread_mutex_unlock(&heal_trace_lock);
+}
+
+/* The rings are freed when the last instance of the translator is being
+ * destroyed, and no other thread can be using them. */
+void heal_trace_destroy(void)
+{
+    heal_trace_ring_t * ring;
+
+    pthread_mutex_lock(&heal_trace_lock);
+
+    if (--heal_trace_users == 0)
+    {
+        __atomic_add_fetch(&heal_trace_generation, 1, __ATOMIC_RELEASE);
+        while (heal_trace_rings != NULL)
+        {
+            ring = heal_trace_rings;
+            heal_trace_rings = ring->next;
+            GF_FREE(ring);
+        }
+    }
+
+    pthread_mutex_unlock(&heal_trace_lock);
+}
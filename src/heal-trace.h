@@ -0,0 +1,77 @@
+/*
+  Copyright (c) 2012-2013 DataLab, S.L. <http://www.datalab.es>
+
+  This file is part of the features/heal translator for GlusterFS.
+
+  The features/heal translator for GlusterFS is free software: you can
+  redistribute it and/or modify it under the terms of the GNU General
+  Public License as published by the Free Software Foundation, either
+  version 3 of the License, or (at your option) any later version.
+
+  The features/heal translator for GlusterFS is distributed in the hope
+  that it will be useful, but WITHOUT ANY WARRANTY; without even the
+  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE. See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with the features/heal translator for GlusterFS. If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __HEAL_TRACE_H__
+#define __HEAL_TRACE_H__
+
+#define HEAL_TRACE_EVENTS 1024
+
+enum
+{
+    HEAL_TRACE_START = 1,
+    HEAL_TRACE_PROGRESS,
+    HEAL_TRACE_REJECT,
+    HEAL_TRACE_TRUNCATE,
+    HEAL_TRACE_RELEASE,
+    HEAL_TRACE_ABORT,
+    HEAL_TRACE_TAKEOVER,
+    HEAL_TRACE_COMMIT
+};
+
+typedef struct _heal_trace_event
+{
+    uint64_t seq;
+    uint64_t time;
+    uint32_t type;
+    uuid_t gfid;
+    uint64_t arg1;
+    uint64_t arg2;
+} heal_trace_event_t;
+
+/* Events are only written by the thread that owns the ring. When the thread
+ * exits the ring is marked as free and reused by the next new thread. */
+typedef struct _heal_trace_ring
+{
+    struct _heal_trace_ring * next;
+    int32_t free;
+    pid_t tid;
+    uint64_t head;
+    heal_trace_event_t events[HEAL_TRACE_EVENTS];
+} heal_trace_ring_t;
+
+/* Event returned by heal_trace_collect(). All fields are stored in network
+ * byte order. 'time' is in nanoseconds of a monotonic clock. */
+typedef struct _heal_trace_record
+{
+    uint64_t time;
+    uint32_t tid;
+    uint32_t type;
+    uuid_t gfid;
+    uint64_t arg1;
+    uint64_t arg2;
+} __attribute__((__packed__)) heal_trace_record_t;
+
+void heal_trace(uint32_t type, uuid_t gfid, uint64_t arg1, uint64_t arg2);
+int32_t heal_trace_collect(void ** data, uint32_t * length);
+void heal_trace_dump(void);
+void heal_trace_init(void);
+void heal_trace_destroy(void);
+
+#endif /* __HEAL_TRACE_H__ */
@@ -20,6 +20,7 @@
 
 #include "byte-order.h"
 #include <xlator.h>
+#include <checksum.h>
 
 #include "heal.h"
 #include "heal-type-dict.h"
@@ -27,7 +28,10 @@
 int32_t heal_dict_special(const char * name)
 {
     if ((strcmp(HEAL_KEY_FLAGS, name) == 0) ||
-        (strcmp(HEAL_KEY_SIZE, name) == 0))
+        (strcmp(HEAL_KEY_SIZE, name) == 0) ||
+        (strcmp(HEAL_KEY_VERSION, name) == 0) ||
+        (strcmp(HEAL_KEY_ATTR, name) == 0) ||
+        (strcmp(HEAL_KEY_REMOVE, name) == 0))
     {
         return 1;
     }
@@ -83,6 +87,80 @@ int32_t heal_dict_equal(dict_t * dst, dict_t * src)
     return (dict_foreach(dst, heal_dict_equal_enum, src) == 0);
 }
 
+typedef struct _heal_dict_fingerprint
+{
+    const char * prefix;
+    const char * exclude;
+    uint64_t high;
+    uint64_t low;
+} heal_dict_fingerprint_t;
+
+static int heal_dict_fingerprint_enum(dict_t * src, char * key, data_t * value, void * arg)
+{
+    heal_dict_fingerprint_t * fp;
+    uint8_t digest[16];
+    uint64_t high, low;
+    uint8_t * buffer;
+    size_t length;
+
+    fp = arg;
+
+    if (((fp->prefix != NULL) && (strncmp(key, fp->prefix, strlen(fp->prefix)) != 0)) ||
+        ((fp->exclude != NULL) && (strncmp(key, fp->exclude, strlen(fp->exclude)) == 0)))
+    {
+        return 0;
+    }
+
+    // The name is hashed with its terminator so that moving bytes between
+    // the name and the value changes the hash.
+    length = strlen(key) + 1;
+    buffer = GF_MALLOC(length + value->len, gf_heal_mt_uint8_t);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    memcpy(buffer, key, length);
+    memcpy(buffer + length, value->data, value->len);
+    gf_rsync_strong_checksum(buffer, length + value->len, digest);
+    GF_FREE(buffer);
+
+    memcpy(&high, digest, sizeof(high));
+    memcpy(&low, digest + sizeof(high), sizeof(low));
+    high = ntoh64(high);
+    low = ntoh64(low);
+
+    fp->low += low;
+    fp->high += high + (fp->low < low);
+
+    return 0;
+}
+
+/* Computes a 128 bits hash of the keys and values of 'src' that doesn't
+ * depend on their order: the sum of the MD5 of each pair. Keys that don't
+ * start by 'prefix' or that start by 'exclude' are ignored. */
+int32_t heal_dict_fingerprint(dict_t * src, const char * prefix, const char * exclude, uint8_t * digest)
+{
+    heal_dict_fingerprint_t fp;
+    uint64_t value;
+
+    fp.prefix = prefix;
+    fp.exclude = exclude;
+    fp.high = 0;
+    fp.low = 0;
+
+    if ((src != NULL) && (dict_foreach(src, heal_dict_fingerprint_enum, &fp) != 0))
+    {
+        return ENOMEM;
+    }
+
+    value = hton64(fp.high);
+    memcpy(digest, &value, sizeof(value));
+    value = hton64(fp.low);
+    memcpy(digest + sizeof(value), &value, sizeof(value));
+
+    return 0;
+}
+
 int32_t heal_dict_set_cow(dict_t ** dst, char * key, data_t * value)
 {
     dict_t * new;
@@ -115,7 +193,8 @@ int32_t heal_dict_set_bin_cow(dict_t ** dst, char * key, void * value, uint32_t
     if ((*dst)->refcount != 1)
     {
         tmp = dict_get(*dst, key);
-        if ((tmp == NULL) || (heal_dict_data_compare(value, tmp) != 0))
+        if ((tmp == NULL) || (tmp->len != length) ||
+            (memcmp(tmp->data, value, length) != 0))
         {
             new = dict_copy(*dst, NULL);
             if (new == NULL)
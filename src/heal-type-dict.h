@@ -23,6 +23,7 @@
 
 int32_t heal_dict_data_compare(data_t * dst, data_t * src);
 int32_t heal_dict_equal(dict_t * dst, dict_t * src);
+int32_t heal_dict_fingerprint(dict_t * src, const char * prefix, const char * exclude, uint8_t * digest);
 int32_t heal_dict_set_cow(dict_t ** dst, char * key, data_t * value);
 int32_t heal_dict_set_bin_cow(dict_t ** dst, char * key, void * value, uint32_t length);
 int32_t heal_dict_set_int8_cow(dict_t ** dst, char * key, int8_t value);
@@ -20,22 +20,211 @@
 
 #include <xlator.h>
 #include <defaults.h>
+#include <call-stub.h>
+#include <statedump.h>
+#include <checksum.h>
 
 #include "heal.h"
 #include "heal-type-dict.h"
+#include "heal-range.h"
+#include "heal-compress.h"
+#include "heal-stream.h"
 
 typedef struct _heal_inode_ctx
 {
     int32_t healing;
+    int32_t aborted;
     uint64_t size;
     uint64_t offset;
+    uint64_t version;
+    int32_t meta_healing;
+    uint32_t meta_pending;
+    struct list_head meta_stubs;
+    int32_t heal_writing;
+    uint32_t trunc_pending;
+    struct list_head write_stubs;
+    heal_map_t * map;
+    heal_ranges_t dirty;
+    heal_ranges_t dirty_pending;
+    uint64_t dirty_gen;
+    int32_t dirty_syncing;
+    struct list_head dirty_stubs;
+    uint32_t lease;
+    time_t renewed;
+    uint64_t heal_started;
+    uint64_t heal_base;
+    uint64_t committed;
+    uint8_t fingerprint[HEAL_CHECKSUM_SIZE];
+    uint64_t fingerprint_version;
+    int32_t fingerprint_valid;
+    int32_t journal;
+    heal_ranges_t written;
+    uint32_t journal_pending;
+    uint64_t heal_end;
+    uint64_t generation;
+    uint64_t gen_reserved;
+    uint64_t gen_reserving;
+    int32_t gen_loaded;
+    uint64_t data_version;
+    int32_t committing;
+    struct list_head commit_stubs;
 } heal_inode_ctx_t;
 
 typedef struct _heal_fd_ctx
 {
     int32_t healing;
+    uint32_t lease;
+    heal_stream_t * stream;
 } heal_fd_ctx_t;
 
+typedef struct _heal_inline_local
+{
+    inode_t * inode;
+    fd_t * fd;
+    dict_t * xdata;
+    dict_t * xattrs;
+    struct iovec vector;
+    struct iobref * iobref;
+    uint32_t lease;
+    struct iatt attr;
+    struct iatt attr_ppre;
+    struct iatt attr_ppost;
+    dict_t * reply;
+} heal_inline_local_t;
+
+typedef struct _heal_meta_local
+{
+    inode_t * inode;
+    loc_t * loc;
+    fd_t * fd;
+    dict_t * xattrs;
+    int32_t flags;
+    struct iatt attr;
+    int32_t valid;
+    char * remove;
+    uint32_t remove_size;
+    int32_t step;
+    heal_inline_local_t * owner;
+} heal_meta_local_t;
+
+typedef struct _heal_write_local
+{
+    inode_t * inode;
+    fd_t * fd;
+    struct iovec * vector;
+    int32_t count;
+    size_t length;
+    uint64_t size;
+    struct iovec * data;
+    int32_t data_count;
+    heal_map_t * map;
+    int32_t result;
+    int32_t code;
+    struct iatt attr_pre;
+    struct iatt attr_post;
+    dict_t * xdata;
+    int32_t check;
+    uint8_t checksum[HEAL_CHECKSUM_SIZE];
+    off_t offset;
+    uint32_t flags;
+    struct iobref * iobref;
+    dict_t * request;
+    struct iovec merged;
+} heal_write_local_t;
+
+typedef struct _heal_unlink_local
+{
+    inode_t * inode;
+    struct iatt attr_ppre;
+    struct iatt attr_ppost;
+    dict_t * xdata;
+} heal_unlink_local_t;
+
+typedef struct _heal_dirty_local
+{
+    inode_t * inode;
+    call_stub_t * stub;
+    void (* fail)(call_stub_t * stub, int32_t error);
+} heal_dirty_local_t;
+
+typedef struct _heal_xattrop_local
+{
+    fd_t * fd;
+    inode_t * tracked;
+    uint64_t offset;
+    int32_t done;
+    dict_t * reply;
+    gf_xattrop_flags_t optype;
+    dict_t * dict;
+    dict_t * xdata;
+} heal_xattrop_local_t;
+
+typedef struct _heal_fingerprint_local
+{
+    inode_t * inode;
+    uint64_t version;
+    int32_t cacheable;
+    char * name;
+} heal_fingerprint_local_t;
+
+typedef struct _heal_extents_local
+{
+    fd_t * fd;
+    struct iovec * vector;
+    int32_t count;
+    struct iovec * slice;
+    uint32_t flags;
+    struct iobref * iobref;
+    dict_t * request;
+    heal_extent_t * extents;
+    int32_t * results;
+    uint32_t number;
+    uint32_t index;
+    size_t position;
+    int32_t code;
+    struct iatt attr_pre;
+    struct iatt attr_post;
+    dict_t * reply;
+    gf_lock_t lock;
+    int32_t winding;
+    int32_t completed;
+} heal_extents_local_t;
+
+#define HEAL_LOOKUP_VERSION       0x01
+#define HEAL_LOOKUP_DIRTY         0x02
+#define HEAL_LOOKUP_DIRTY_GEN     0x04
+#define HEAL_LOOKUP_STATE         0x08
+#define HEAL_LOOKUP_GEN_LOAD      0x10
+#define HEAL_LOOKUP_GEN           0x20
+#define HEAL_LOOKUP_DIRTY_OWN     0x40
+#define HEAL_LOOKUP_DIRTY_GEN_OWN 0x80
+
+/* Metadata versions of new inode contexts are taken from this counter so
+ * that a forgotten and reloaded inode never reuses an old version. */
+static uint64_t heal_version_seed = 0;
+
+/* Each healer owns the heal through a lease identified by a value taken
+ * from this counter. */
+static uint32_t heal_lease_seed = 0;
+
+static time_t heal_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+static uint64_t heal_now_msec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 int32_t __heal_inode_ctx_get(heal_inode_ctx_t ** ctx, xlator_t * xl, inode_t * inode)
 {
     uint64_t value;
@@ -82,8 +271,39 @@ int32_t heal_inode_ctx_new(heal_inode_ctx_t ** ctx, xlator_t * xl, inode_t * ino
         if (*ctx != NULL)
         {
             (*ctx)->healing = healing;
+            (*ctx)->aborted = 0;
             (*ctx)->size = size;
             (*ctx)->offset = 0;
+            (*ctx)->version = __sync_add_and_fetch(&heal_version_seed, 1);
+            (*ctx)->meta_healing = 0;
+            (*ctx)->meta_pending = 0;
+            INIT_LIST_HEAD(&(*ctx)->meta_stubs);
+            (*ctx)->heal_writing = 0;
+            (*ctx)->trunc_pending = 0;
+            INIT_LIST_HEAD(&(*ctx)->write_stubs);
+            (*ctx)->map = NULL;
+            heal_ranges_init(&(*ctx)->dirty);
+            heal_ranges_init(&(*ctx)->dirty_pending);
+            (*ctx)->dirty_gen = 0;
+            (*ctx)->dirty_syncing = 0;
+            INIT_LIST_HEAD(&(*ctx)->dirty_stubs);
+            (*ctx)->lease = healing ? __sync_add_and_fetch(&heal_lease_seed, 1) : 0;
+            (*ctx)->renewed = heal_now();
+            (*ctx)->heal_started = heal_now_msec();
+            (*ctx)->heal_base = 0;
+            (*ctx)->committed = 0;
+            (*ctx)->fingerprint_valid = 0;
+            (*ctx)->journal = 0;
+            heal_ranges_init(&(*ctx)->written);
+            (*ctx)->journal_pending = 0;
+            (*ctx)->heal_end = 0;
+            (*ctx)->generation = 0;
+            (*ctx)->gen_reserved = 0;
+            (*ctx)->gen_reserving = 0;
+            (*ctx)->gen_loaded = 0;
+            (*ctx)->data_version = 0;
+            (*ctx)->committing = 0;
+            INIT_LIST_HEAD(&(*ctx)->commit_stubs);
             value = (uint64_t)(uintptr_t)*ctx;
             if (__inode_ctx_put(inode, xl, value) != 0)
             {
@@ -105,20 +325,296 @@ int32_t heal_inode_ctx_new(heal_inode_ctx_t ** ctx, xlator_t * xl, inode_t * ino
     return error;
 }
 
-void heal_inode_clear_healing(xlator_t * xl, inode_t * inode)
+/* Finishes the heal owned by 'lease'. If the lease is 0, the heal is
+ * finished whoever owns it. */
+void heal_inode_clear_healing(xlator_t * xl, inode_t * inode, uint32_t lease)
+{
+    heal_private_t * priv;
+    heal_inode_ctx_t * ctx;
+    heal_map_t * map;
+    int32_t error, healing;
+
+    priv = xl->private;
+    map = NULL;
+    healing = 0;
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if ((error == 0) && ((lease == 0) || (lease == ctx->lease)))
+    {
+        healing = ctx->healing;
+        ctx->healing = 0;
+        map = ctx->map;
+        ctx->map = NULL;
+        ctx->journal = 0;
+        heal_ranges_clear(&ctx->written);
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (healing != 0)
+    {
+        heal_registry_del(&priv->registry, inode->gfid);
+    }
+
+    if (map != NULL)
+    {
+        heal_map_destroy(map);
+    }
+}
+
+/* Adds a heal that has just been started or taken over to the registry
+ * of active heals. Returns the lease of the heal. 'gfid' is needed because
+ * inodes of new files are not linked yet when the create is answered. */
+uint32_t heal_inode_register(xlator_t * xl, inode_t * inode, uuid_t gfid, call_frame_t * frame)
+{
+    heal_private_t * priv;
+    heal_inode_ctx_t * ctx;
+    uint64_t size, offset;
+    uint32_t lease;
+    int32_t error;
+
+    priv = xl->private;
+    size = offset = 0;
+    lease = 0;
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if ((error == 0) && (ctx->healing == 0))
+    {
+        error = ENOENT;
+    }
+    if (error == 0)
+    {
+        size = ctx->size;
+        offset = ctx->offset;
+        lease = ctx->lease;
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (error == 0)
+    {
+        heal_trace(HEAL_TRACE_START, gfid, offset, size);
+
+        if (heal_registry_add(&priv->registry, gfid, size, frame) != 0)
+        {
+            gf_log(xl->name, GF_LOG_WARNING, "Unable to register the heal of %s", uuid_utoa(gfid));
+        }
+        else if (offset != 0)
+        {
+            heal_registry_update(&priv->registry, gfid, size, offset);
+        }
+    }
+
+    return lease;
+}
+
+/* Transfers the heal of 'inode' to a new healer if the current one has
+ * not sent any heal request during the lease timeout. */
+int32_t heal_inode_takeover(xlator_t * xl, inode_t * inode, uint32_t * lease)
 {
+    heal_private_t * priv;
     heal_inode_ctx_t * ctx;
+    uint64_t offset;
+    time_t now;
     int32_t error;
 
+    priv = xl->private;
+    now = heal_now();
+    offset = 0;
+
     LOCK(&inode->lock);
 
     error = __heal_inode_ctx_get(&ctx, xl, inode);
     if (error == 0)
+    {
+        if (ctx->healing == 0)
+        {
+            error = ENOENT;
+        }
+        else if ((priv->lease_timeout == 0) || (now - ctx->renewed < priv->lease_timeout))
+        {
+            error = EBUSY;
+        }
+        else if (ctx->heal_writing != 0)
+        {
+            // The progress point is not known until the pending heal write
+            // finishes.
+            error = EAGAIN;
+        }
+        else
+        {
+            ctx->lease = __sync_add_and_fetch(&heal_lease_seed, 1);
+            ctx->renewed = now;
+            ctx->heal_started = heal_now_msec();
+            ctx->heal_base = ctx->offset;
+            offset = ctx->offset;
+            *lease = ctx->lease;
+        }
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (error == 0)
+    {
+        heal_trace(HEAL_TRACE_TAKEOVER, inode->gfid, offset, *lease);
+
+        gf_log(xl->name, GF_LOG_INFO, "Heal of %s taken over at offset %lu", uuid_utoa(inode->gfid), offset);
+    }
+
+    return error;
+}
+
+/* Starts computing the integrity map of a heal that has just begun. */
+void heal_inode_map_init(xlator_t * xl, inode_t * inode, uint64_t size)
+{
+    heal_private_t * priv;
+    heal_inode_ctx_t * ctx;
+    heal_map_t * map;
+
+    priv = xl->private;
+    if (!priv->integrity || (size == 0))
+    {
+        return;
+    }
+
+    map = heal_map_new(size, priv->block_size);
+    if (map == NULL)
+    {
+        return;
+    }
+
+    LOCK(&inode->lock);
+
+    if ((__heal_inode_ctx_get(&ctx, xl, inode) == 0) && (ctx->map == NULL))
+    {
+        ctx->map = map;
+        map = NULL;
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (map != NULL)
+    {
+        heal_map_destroy(map);
+    }
+}
+
+/* Cancels the heal in progress, if any. Further heal requests for this
+ * inode will fail with ENOENT. */
+void heal_inode_abort_healing(xlator_t * xl, inode_t * inode, const char * reason)
+{
+    heal_private_t * priv;
+    heal_inode_ctx_t * ctx;
+    int32_t error;
+
+    priv = xl->private;
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if ((error == 0) && (ctx->healing != 0))
     {
         ctx->healing = 0;
+        ctx->aborted = 1;
+        ctx->size = 0;
+        ctx->offset = 0;
+        ctx->journal = 0;
+        heal_ranges_clear(&ctx->written);
+        if (ctx->map != NULL)
+        {
+            ctx->map->invalid = 1;
+        }
+    }
+    else
+    {
+        error = ENOENT;
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (error == 0)
+    {
+        heal_registry_del(&priv->registry, inode->gfid);
+        heal_trace(HEAL_TRACE_ABORT, inode->gfid, 0, 0);
+
+        gf_log(xl->name, GF_LOG_INFO, "Heal of %s cancelled because %s", uuid_utoa(inode->gfid), reason);
+    }
+}
+
+/* Puts an existing file in heal mode keeping its current contents. Only
+ * the area between 'offset' and 'size' will be healed. In journal mode,
+ * clients can still write to the area not healed yet. */
+int32_t heal_inode_start(xlator_t * xl, inode_t * inode, uint64_t size, uint64_t offset, int32_t journal, uint32_t * lease)
+{
+    heal_private_t * priv;
+    heal_inode_ctx_t * ctx;
+    int32_t error;
+
+    if (offset > size)
+    {
+        return EINVAL;
+    }
+
+    // The heal always starts at a unit boundary. Healing again the start of
+    // a partially valid unit is harmless.
+    priv = xl->private;
+    if (priv->granularity != 0)
+    {
+        offset -= offset % priv->granularity;
+    }
+
+    error = heal_inode_ctx_new(&ctx, xl, inode, 0, 0);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    LOCK(&inode->lock);
+
+    if (ctx->healing != 0)
+    {
+        error = EBUSY;
+    }
+    else if ((ctx->trunc_pending != 0) || (ctx->heal_writing != 0) || (ctx->journal_pending != 0))
+    {
+        error = EAGAIN;
+    }
+    else
+    {
+        ctx->healing = 1;
+        ctx->aborted = 0;
+        ctx->size = size;
+        ctx->offset = offset;
+        ctx->journal = journal;
+        heal_ranges_clear(&ctx->written);
+        ctx->lease = __sync_add_and_fetch(&heal_lease_seed, 1);
+        ctx->renewed = heal_now();
+        ctx->heal_started = heal_now_msec();
+        ctx->heal_base = offset;
+        ctx->committed = offset;
+        *lease = ctx->lease;
     }
 
     UNLOCK(&inode->lock);
+
+    if (error != 0)
+    {
+        return error;
+    }
+
+    // The integrity map can only be computed if the whole file is healed.
+    if (offset == 0)
+    {
+        heal_inode_map_init(xl, inode, size);
+    }
+
+    gf_log(xl->name, GF_LOG_INFO, "In place heal of %s started (%lu - %lu)", uuid_utoa(inode->gfid), offset, size);
+
+    return 0;
 }
 
 int32_t __heal_fd_ctx_get(heal_fd_ctx_t ** ctx, xlator_t * xl, fd_t * fd)
@@ -161,6 +657,9 @@ int32_t heal_fd_ctx_new(heal_fd_ctx_t ** ctx, xlator_t * xl, fd_t * fd)
         *ctx = GF_MALLOC(sizeof(heal_fd_ctx_t), gf_heal_mt_heal_fd_ctx_t);
         if (*ctx != NULL)
         {
+            (*ctx)->healing = 0;
+            (*ctx)->lease = 0;
+            (*ctx)->stream = NULL;
             value = (uint64_t)(uintptr_t)*ctx;
             if (__fd_ctx_set(fd, xl, value) != 0)
             {
@@ -183,520 +682,5252 @@ int32_t heal_fd_ctx_new(heal_fd_ctx_t ** ctx, xlator_t * xl, fd_t * fd)
     return error;
 }
 
-int32_t heal_inode_ctx_check(xlator_t * xl, inode_t * inode)
+/* Estimates the milliseconds needed for the heal to reach 'end' from the
+ * throughput observed since the heal was started or taken over. */
+uint32_t __heal_retry_estimate(heal_inode_ctx_t * ctx, uint64_t end)
 {
-    heal_inode_ctx_t * ctx;
-    int32_t error;
+    uint64_t distance, healed, elapsed;
+    double wait;
 
-    if (inode->ia_type != IA_IFREG)
+    if (end > ctx->size)
     {
-        return 0;
+        end = ctx->size;
     }
+    distance = (end > ctx->offset) ? end - ctx->offset : 0;
+    healed = (ctx->offset > ctx->heal_base) ? ctx->offset - ctx->heal_base : 0;
+    elapsed = heal_now_msec() - ctx->heal_started;
 
-    error = heal_inode_ctx_get(&ctx, xl, inode);
-    if (error == 0)
+    if ((healed == 0) || (elapsed == 0))
     {
-        if (ctx->healing == 0)
-        {
-            return 0;
-        }
+        return HEAL_RETRY_DEFAULT;
+    }
 
-        error = EPERM;
+    wait = (double)distance * elapsed / healed;
+    if (wait < HEAL_RETRY_MIN)
+    {
+        return HEAL_RETRY_MIN;
+    }
+    if (wait > HEAL_RETRY_MAX)
+    {
+        return HEAL_RETRY_MAX;
     }
 
-    return error;
+    return wait;
 }
 
-int32_t heal_inode_ctx_check_range(xlator_t * xl, inode_t * inode, uint64_t start, uint64_t end)
+/* Returns the end of the area of the file that clients can access. When a
+ * heal granularity is configured, a partially healed unit is still treated
+ * as not healed so that no client write can split it. */
+uint64_t __heal_healed_end(heal_private_t * priv, heal_inode_ctx_t * ctx)
 {
-    heal_inode_ctx_t * ctx;
-    int32_t error;
-
-    if (inode->ia_type != IA_IFREG)
+    if ((priv->granularity == 0) || (ctx->offset >= ctx->size))
     {
-        return 0;
+        return ctx->offset;
     }
 
-    error = heal_inode_ctx_get(&ctx, xl, inode);
-    if (error == 0)
-    {
-        if ((ctx->healing == 0) || (end <= ctx->offset) || (start >= ctx->size))
-        {
-            return 0;
-        }
+    return ctx->offset - ctx->offset % priv->granularity;
+}
+
+/* Rounds 'offset' up to the next heal granularity boundary. */
+uint64_t heal_granularity_round_up(heal_private_t * priv, uint64_t offset)
+{
+    uint64_t rest;
 
-        error = EPERM;
+    if (priv->granularity == 0)
+    {
+        return offset;
     }
 
-    return error;
+    rest = offset % priv->granularity;
+
+    return (rest == 0) ? offset : offset + priv->granularity - rest;
 }
 
-int32_t heal_access(call_frame_t * frame, xlator_t * xl, loc_t * loc, int32_t mask, dict_t * xdata)
+/* Builds the xdata of a request rejected because the file is being healed.
+ * It contains the estimated time after which the request can be retried. */
+dict_t * heal_retry_xdata(uint32_t wait)
 {
-    int32_t error;
+    dict_t * xdata;
 
-    error = heal_inode_ctx_check(xl, loc->inode);
-    if (error == 0)
+    xdata = dict_new();
+    if ((xdata != NULL) && (heal_dict_set_uint32_cow(&xdata, HEAL_KEY_RETRY, wait) != 0))
     {
-        STACK_WIND(frame, default_access_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->access, loc, mask, xdata);
-
-        return 0;
+        dict_unref(xdata);
+        xdata = NULL;
     }
 
-    STACK_UNWIND_STRICT(access, frame, -1, error, NULL);
-
-    return 0;
+    return xdata;
 }
 
-int32_t heal_create_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, fd_t * fd, inode_t * inode, struct iatt * attr, struct iatt * attr_ppre, struct iatt * attr_ppost, dict_t * xdata)
+/* Checks if the area [start, end) of the file can be accessed by a client.
+ * If it hasn't been healed yet, EAGAIN is returned and 'reply' contains the
+ * xdata to return to the client. */
+int32_t heal_inode_ctx_check_range(xlator_t * xl, inode_t * inode, uint64_t start, uint64_t end, dict_t ** reply)
 {
-    inode_t * base;
-    heal_fd_ctx_t * fd_ctx;
+    heal_private_t * priv;
+    heal_inode_ctx_t * ctx;
+    uint32_t wait;
     int32_t error;
 
-    base = cookie;
-    if (base != NULL)
+    *reply = NULL;
+
+    if (inode->ia_type != IA_IFREG)
     {
-        if ((result < 0) || (inode != base))
-        {
-            gf_log(xl->name, GF_LOG_WARNING, "inode changed in create");
+        return 0;
+    }
 
-            heal_inode_clear_healing(xl, base);
-        }
-        if (result >= 0)
+    priv = xl->private;
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if (error == 0)
+    {
+        // In journal mode clients see the old contents of the file until it
+        // is healed.
+        if ((ctx->healing != 0) && (ctx->journal == 0) && (end > __heal_healed_end(priv, ctx)) && (start < ctx->size))
         {
-            error = heal_fd_ctx_new(&fd_ctx, xl, fd);
-            if (error != 0)
-            {
-                code = error;
-                result = -1;
-            }
-            else
+            if (end <= ctx->offset)
             {
-                fd_ctx->healing = 1;
+                __sync_fetch_and_add(&priv->unaligned_conflicts, 1);
             }
+            wait = __heal_retry_estimate(ctx, heal_granularity_round_up(priv, end));
+            error = EAGAIN;
         }
     }
 
-    STACK_UNWIND_STRICT(create, frame, result, code, fd, inode, attr, attr_ppre, attr_ppost, xdata);
+    UNLOCK(&inode->lock);
 
-    if (base != NULL)
+    if (error == EAGAIN)
     {
-        inode_unref(base);
+        heal_trace(HEAL_TRACE_REJECT, inode->gfid, start, end);
+
+        *reply = heal_retry_xdata(wait);
+    }
+    else if (error != 0)
+    {
+        gf_log(xl->name, GF_LOG_ERROR, "Inode context not defined");
     }
 
-    return 0;
+    return error;
 }
 
-int32_t heal_create(call_frame_t * frame, xlator_t * xl, loc_t * loc, int32_t flags, mode_t mode, mode_t umask, fd_t * fd, dict_t * xdata)
+int32_t heal_inode_ctx_check(xlator_t * xl, inode_t * inode, dict_t ** reply)
 {
-    heal_inode_ctx_t * ctx;
+    return heal_inode_ctx_check_range(xl, inode, 0, UINT64_MAX, reply);
+}
+
+/* Records a client write to the area not healed yet of a journal mode
+ * heal. Heal writes keep the recorded data, so the ranges must be exact:
+ * when the set is full, only writes that can be merged with a recorded
+ * range are accepted and EAGAIN is returned for the others. */
+int32_t __heal_journal_add(heal_inode_ctx_t * ctx, uint64_t start, uint64_t end)
+{
+    if (start < ctx->offset)
+    {
+        start = ctx->offset;
+    }
+    if (end > ctx->size)
+    {
+        end = ctx->size;
+    }
+
+    if ((ctx->written.count >= HEAL_RANGES_MAX) && !heal_ranges_touches(&ctx->written, start, end))
+    {
+        return EAGAIN;
+    }
+    if (heal_ranges_add(&ctx->written, start, end) != 0)
+    {
+        return EAGAIN;
+    }
+    ctx->journal_pending++;
+
+    return 0;
+}
+
+dict_t * heal_xdata_ref(dict_t * xdata)
+{
+    if (xdata == NULL)
+    {
+        return dict_new();
+    }
+
+    return dict_ref(xdata);
+}
+
+int32_t heal_meta_request(dict_t * xdata, uint64_t * version)
+{
+    uint32_t flags;
+
+    if ((xdata == NULL) ||
+        (heal_dict_get_uint32(xdata, HEAL_KEY_FLAGS, &flags) != 0) ||
+        ((flags & HEAL_FLAG_METADATA) == 0))
+    {
+        return 0;
+    }
+
+    if (heal_dict_get_uint64(xdata, HEAL_KEY_VERSION, version) != 0)
+    {
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Called before sending a metadata change from a normal client. Returns 0
+ * if the request can be sent (and *tracked tells if the inode has been
+ * accounted), EINPROGRESS if a metadata heal is running and the request
+ * must be queued, or an error code. */
+int32_t heal_meta_client_begin(xlator_t * xl, inode_t * inode, int32_t * tracked)
+{
+    heal_inode_ctx_t * ctx;
+    int32_t error;
+
+    *tracked = 0;
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if (error == 0)
+    {
+        if (ctx->meta_healing != 0)
+        {
+            error = EINPROGRESS;
+        }
+        else
+        {
+            ctx->version++;
+            ctx->meta_pending++;
+            *tracked = 1;
+        }
+    }
+    else
+    {
+        error = 0;
+    }
+
+    UNLOCK(&inode->lock);
+
+    return error;
+}
+
+void heal_meta_client_end(xlator_t * xl, inode_t * inode)
+{
+    heal_inode_ctx_t * ctx;
+
+    LOCK(&inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, inode) == 0)
+    {
+        ctx->meta_pending--;
+    }
+
+    UNLOCK(&inode->lock);
+
+    inode_unref(inode);
+}
+
+/* Delays a client metadata request until the running metadata heal
+ * finishes. If the heal has already finished, the request is resumed
+ * immediately. */
+int32_t heal_meta_client_queue(xlator_t * xl, inode_t * inode, call_stub_t * stub)
+{
+    heal_inode_ctx_t * ctx;
+    int32_t error;
+
+    if (stub == NULL)
+    {
+        return ENOMEM;
+    }
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if ((error == 0) && (ctx->meta_healing != 0))
+    {
+        list_add_tail(&stub->list, &ctx->meta_stubs);
+        stub = NULL;
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (stub != NULL)
+    {
+        call_resume(stub);
+    }
+
+    return 0;
+}
+
+void heal_meta_next(call_frame_t * frame, xlator_t * xl, heal_meta_local_t * local);
+void heal_create_inline_done(call_frame_t * frame, xlator_t * xl, heal_inline_local_t * local, int32_t error);
+
+/* Finishes a metadata heal. The steps are not applied atomically, so if
+ * one of them fails the metadata can be partially healed. The reply then
+ * fails with EAGAIN and contains the step that failed and its error, and
+ * the healer must send the whole set again. */
+void heal_meta_done(call_frame_t * frame, xlator_t * xl, heal_meta_local_t * local, int32_t step, int32_t error)
+{
+    struct list_head stubs;
+    heal_inode_ctx_t * ctx;
+    call_stub_t * stub, * tmp;
+    dict_t * xdata;
+
+    INIT_LIST_HEAD(&stubs);
+
+    LOCK(&local->inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, local->inode) == 0)
+    {
+        ctx->meta_healing = 0;
+        // The xattrs have been replaced without changing the version, even
+        // if the heal has failed halfway.
+        ctx->fingerprint_valid = 0;
+        list_splice_init(&ctx->meta_stubs, &stubs);
+    }
+
+    UNLOCK(&local->inode->lock);
+
+    xdata = NULL;
+    if (error != 0)
+    {
+        gf_log(xl->name, GF_LOG_WARNING, "Metadata heal of %s failed at step %d (error=%d)", uuid_utoa(local->inode->gfid), step, error);
+
+        // An inline heal fails the whole create, so it's retried anyway.
+        if (local->owner == NULL)
+        {
+            xdata = dict_new();
+            if ((xdata != NULL) &&
+                ((heal_dict_set_uint32_cow(&xdata, HEAL_KEY_META_STEP, step) != 0) ||
+                 (heal_dict_set_uint32_cow(&xdata, HEAL_KEY_META_ERROR, error) != 0)))
+            {
+                dict_unref(xdata);
+                xdata = NULL;
+            }
+            error = EAGAIN;
+        }
+    }
+
+    if (local->owner != NULL)
+    {
+        heal_create_inline_done(frame, xl, local->owner, error);
+    }
+    else if (local->fd != NULL)
+    {
+        STACK_UNWIND_STRICT(fsetxattr, frame, error ? -1 : 0, error, xdata);
+    }
+    else
+    {
+        STACK_UNWIND_STRICT(setxattr, frame, error ? -1 : 0, error, xdata);
+    }
+
+    if (xdata != NULL)
+    {
+        dict_unref(xdata);
+    }
+
+    inode_unref(local->inode);
+    GF_FREE(local);
+
+    list_for_each_entry_safe(stub, tmp, &stubs, list)
+    {
+        list_del_init(&stub->list);
+        call_resume(stub);
+    }
+}
+
+int32_t heal_meta_xattr_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    heal_meta_local_t * local;
+
+    local = cookie;
+    if (result < 0)
+    {
+        heal_meta_done(frame, xl, local, HEAL_META_XATTRS, code);
+    }
+    else
+    {
+        heal_meta_next(frame, xl, local);
+    }
+
+    return 0;
+}
+
+int32_t heal_meta_remove_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    heal_meta_local_t * local;
+
+    local = cookie;
+    if ((result < 0) && (code != ENODATA) && (code != ENOATTR))
+    {
+        heal_meta_done(frame, xl, local, HEAL_META_REMOVE, code);
+    }
+    else
+    {
+        heal_meta_next(frame, xl, local);
+    }
+
+    return 0;
+}
+
+int32_t heal_meta_attr_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    heal_meta_local_t * local;
+
+    local = cookie;
+    if (result < 0)
+    {
+        heal_meta_done(frame, xl, local, HEAL_META_ATTRS, code);
+    }
+    else
+    {
+        heal_meta_next(frame, xl, local);
+    }
+
+    return 0;
+}
+
+/* Applies the next step of a metadata heal: first the xattrs to set, then
+ * the xattrs to remove (one at a time) and finally the attributes. */
+void heal_meta_next(call_frame_t * frame, xlator_t * xl, heal_meta_local_t * local)
+{
+    char * name;
+    size_t length;
+
+    switch (local->step)
+    {
+        case HEAL_META_XATTRS:
+            local->step = HEAL_META_REMOVE;
+            if ((local->xattrs != NULL) && (local->xattrs->count > 0))
+            {
+                if (local->fd != NULL)
+                {
+                    STACK_WIND_COOKIE(frame, heal_meta_xattr_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fsetxattr, local->fd, local->xattrs, local->flags, NULL);
+                }
+                else
+                {
+                    STACK_WIND_COOKIE(frame, heal_meta_xattr_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->setxattr, local->loc, local->xattrs, local->flags, NULL);
+                }
+
+                return;
+            }
+            /* Fall through */
+
+        case HEAL_META_REMOVE:
+            if (local->remove_size > 0)
+            {
+                name = local->remove;
+                length = strlen(name) + 1;
+                local->remove += length;
+                local->remove_size -= length;
+
+                if (local->fd != NULL)
+                {
+                    STACK_WIND_COOKIE(frame, heal_meta_remove_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fremovexattr, local->fd, name, NULL);
+                }
+                else
+                {
+                    STACK_WIND_COOKIE(frame, heal_meta_remove_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->removexattr, local->loc, name, NULL);
+                }
+
+                return;
+            }
+            local->step = HEAL_META_ATTRS;
+            /* Fall through */
+
+        case HEAL_META_ATTRS:
+            local->step = HEAL_META_DONE;
+            if (local->valid != 0)
+            {
+                if (local->fd != NULL)
+                {
+                    STACK_WIND_COOKIE(frame, heal_meta_attr_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fsetattr, local->fd, &local->attr, local->valid, NULL);
+                }
+                else
+                {
+                    STACK_WIND_COOKIE(frame, heal_meta_attr_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->setattr, local->loc, &local->attr, local->valid, NULL);
+                }
+
+                return;
+            }
+            /* Fall through */
+
+        default:
+            heal_meta_done(frame, xl, local, HEAL_META_DONE, 0);
+    }
+}
+
+int32_t heal_meta_decode(heal_meta_local_t * local, dict_t * xdata)
+{
+    heal_attr_t attr;
+    data_t * data;
+    uint32_t length;
+    int32_t error;
+
+    length = sizeof(attr);
+    error = heal_dict_get_bin(xdata, HEAL_KEY_ATTR, &attr, &length);
+    if (error == 0)
+    {
+        if (length != sizeof(attr))
+        {
+            return EINVAL;
+        }
+
+        memset(&local->attr, 0, sizeof(local->attr));
+        local->valid = ntoh32(attr.valid) & (GF_SET_ATTR_MODE | GF_SET_ATTR_UID | GF_SET_ATTR_GID | GF_SET_ATTR_ATIME | GF_SET_ATTR_MTIME);
+        local->attr.ia_prot = ia_prot_from_st_mode(ntoh32(attr.mode));
+        local->attr.ia_uid = ntoh32(attr.uid);
+        local->attr.ia_gid = ntoh32(attr.gid);
+        local->attr.ia_atime = ntoh64(attr.atime);
+        local->attr.ia_atime_nsec = ntoh32(attr.atime_nsec);
+        local->attr.ia_mtime = ntoh64(attr.mtime);
+        local->attr.ia_mtime_nsec = ntoh32(attr.mtime_nsec);
+    }
+    else if (error != ENOENT)
+    {
+        return EINVAL;
+    }
+
+    data = dict_get(xdata, HEAL_KEY_REMOVE);
+    if ((data != NULL) && (data->len > 0))
+    {
+        if (data->data[data->len - 1] != 0)
+        {
+            return EINVAL;
+        }
+        local->remove = data->data;
+        local->remove_size = data->len;
+    }
+
+    return 0;
+}
+
+/* Applies a full set of metadata sent by a healer in a single request. The
+ * heal is only applied if no client has modified the metadata since the
+ * healer read the version. Client metadata requests received while it is
+ * being applied are delayed until it finishes. */
+int32_t heal_meta_heal(call_frame_t * frame, xlator_t * xl, inode_t * inode, loc_t * loc, fd_t * fd, dict_t * xattrs, int32_t flags, dict_t * xdata, uint64_t version)
+{
+    heal_meta_local_t * local;
+    heal_inode_ctx_t * ctx;
+    int32_t error;
+
+    local = GF_MALLOC(sizeof(heal_meta_local_t), gf_heal_mt_heal_meta_local_t);
+    if (local == NULL)
+    {
+        return ENOMEM;
+    }
+    local->inode = inode;
+    local->loc = loc;
+    local->fd = fd;
+    local->xattrs = xattrs;
+    local->flags = flags;
+    local->valid = 0;
+    local->remove = NULL;
+    local->remove_size = 0;
+    local->step = HEAL_META_XATTRS;
+    local->owner = NULL;
+
+    error = heal_meta_decode(local, xdata);
+    if (error != 0)
+    {
+        goto failed;
+    }
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if (error == 0)
+    {
+        if (ctx->meta_healing != 0)
+        {
+            error = EBUSY;
+        }
+        else if ((ctx->version != version) || (ctx->meta_pending != 0))
+        {
+            error = ESTALE;
+        }
+        else
+        {
+            ctx->meta_healing = 1;
+        }
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (error != 0)
+    {
+        goto failed;
+    }
+
+    inode_ref(inode);
+
+    heal_meta_next(frame, xl, local);
+
+    return 0;
+
+failed:
+    GF_FREE(local);
+
+    return error;
+}
+
+void heal_stubs_resume(struct list_head * stubs)
+{
+    call_stub_t * stub, * tmp;
+
+    list_for_each_entry_safe(stub, tmp, stubs, list)
+    {
+        list_del_init(&stub->list);
+        call_resume(stub);
+    }
+}
+
+/* Heal writes and truncates are never sent concurrently to the same inode,
+ * otherwise it's not possible to know if a heal write has extended the
+ * file again after a truncate. A heal write is delayed while there are
+ * pending truncates, and a truncate is delayed while a heal write is in
+ * progress. If the condition has already disappeared, the request is
+ * resumed immediately. */
+int32_t heal_data_queue(xlator_t * xl, inode_t * inode, call_stub_t * stub, int32_t heal)
+{
+    heal_inode_ctx_t * ctx;
+
+    if (stub == NULL)
+    {
+        return ENOMEM;
+    }
+
+    LOCK(&inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, inode) == 0)
+    {
+        if ((heal && ((ctx->trunc_pending != 0) || (ctx->journal_pending != 0))) ||
+            (!heal && (ctx->heal_writing != 0)))
+        {
+            list_add_tail(&stub->list, &ctx->write_stubs);
+            stub = NULL;
+        }
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (stub != NULL)
+    {
+        call_resume(stub);
+    }
+
+    return 0;
+}
+
+int32_t heal_truncate_begin(xlator_t * xl, inode_t * inode)
+{
+    heal_inode_ctx_t * ctx;
+    int32_t error;
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if (error == 0)
+    {
+        if (ctx->heal_writing != 0)
+        {
+            error = EINPROGRESS;
+        }
+        else
+        {
+            ctx->trunc_pending++;
+        }
+    }
+
+    UNLOCK(&inode->lock);
+
+    return error;
+}
+
+/* Updates the heal target after a truncate. If the file has been shrunk,
+ * nothing beyond the new size needs to be healed anymore. If it is later
+ * extended, the new area has been defined by the client, so the heal target
+ * is never increased. */
+int32_t heal_truncate_end(xlator_t * xl, inode_t * inode, int32_t result, struct iatt * attr_post)
+{
+    struct list_head stubs;
+    heal_private_t * priv;
+    heal_inode_ctx_t * ctx;
+    uint64_t size, offset;
+    int32_t error, healing;
+
+    priv = xl->private;
+    healing = 0;
+    size = offset = 0;
+
+    INIT_LIST_HEAD(&stubs);
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if (error == 0)
+    {
+        if ((result >= 0) && (ctx->healing != 0))
+        {
+            if (ctx->size > attr_post->ia_size)
+            {
+                ctx->size = attr_post->ia_size;
+            }
+            if (ctx->offset > ctx->size)
+            {
+                ctx->offset = ctx->size;
+            }
+            if (ctx->committed > ctx->size)
+            {
+                ctx->committed = ctx->size;
+            }
+            if (ctx->map != NULL)
+            {
+                ctx->map->invalid = 1;
+            }
+            healing = 1;
+            size = ctx->size;
+            offset = ctx->offset;
+        }
+        if (--ctx->trunc_pending == 0)
+        {
+            list_splice_init(&ctx->write_stubs, &stubs);
+        }
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (healing != 0)
+    {
+        heal_registry_update(&priv->registry, inode->gfid, size, offset);
+        heal_trace(HEAL_TRACE_TRUNCATE, inode->gfid, size, offset);
+    }
+
+    heal_stubs_resume(&stubs);
+
+    return error;
+}
+
+/* Returns the number of entries of 'src' needed to hold 'length' bytes,
+ * copying them into 'dst' with the last one shortened if necessary. */
+int32_t heal_iov_trim(struct iovec * dst, struct iovec * src, int32_t count, size_t length)
+{
+    int32_t i;
+
+    for (i = 0; (i < count) && (length > 0); i++)
+    {
+        dst[i] = src[i];
+        if (dst[i].iov_len > length)
+        {
+            dst[i].iov_len = length;
+        }
+        length -= dst[i].iov_len;
+    }
+
+    return i;
+}
+
+int32_t heal_loc_is_root(loc_t * loc)
+{
+    if (((loc->inode != NULL) && __is_root_gfid(loc->inode->gfid)) ||
+        __is_root_gfid(loc->gfid))
+    {
+        return 1;
+    }
+
+    return (loc->path != NULL) && (strcmp(loc->path, "/") == 0);
+}
+
+/* Checks if a client modification of the range [start, end) needs to be
+ * recorded in the dirty region journal before being sent. Returns 0 if
+ * the request can be sent, EINPROGRESS if it must wait until the journal
+ * is stored, or EAGAIN if the caller must store the encoded journal
+ * returned in 'data'. Ranges are recorded with the granularity of the
+ * journal, so sequential writes only need to store it occasionally. */
+int32_t __heal_dirty_check(xlator_t * xl, heal_inode_ctx_t * ctx, uint64_t start, uint64_t end, void ** data, uint32_t * length)
+{
+    heal_private_t * priv;
+    heal_ranges_t pending;
+    uint64_t gen, granularity;
+    int32_t error;
+
+    priv = xl->private;
+    gen = priv->dirty_gen;
+    if (gen == 0)
+    {
+        return 0;
+    }
+
+    // All modifications made while this generation has been active have
+    // been seen by this context, so anything it contains belongs to an
+    // older generation.
+    if (ctx->dirty_gen != gen)
+    {
+        heal_ranges_clear(&ctx->dirty);
+        ctx->dirty_gen = gen;
+    }
+
+    if (ctx->dirty_syncing != 0)
+    {
+        return EINPROGRESS;
+    }
+
+    granularity = priv->dirty_granularity;
+    start -= start % granularity;
+    if (end > UINT64_MAX - granularity)
+    {
+        end = UINT64_MAX;
+    }
+    else
+    {
+        end += granularity - 1;
+        end -= end % granularity;
+    }
+
+    if (heal_ranges_contains(&ctx->dirty, start, end))
+    {
+        return 0;
+    }
+
+    // The journal of the context is only updated once the new one has been
+    // stored, so that no request relies on a range that is not persisted.
+    heal_ranges_init(&pending);
+    error = heal_ranges_copy(&pending, &ctx->dirty);
+    if (error == 0)
+    {
+        error = heal_ranges_add(&pending, start, end);
+    }
+    if (error == 0)
+    {
+        error = heal_ranges_encode(&pending, gen, data, length);
+    }
+    if (error != 0)
+    {
+        heal_ranges_clear(&pending);
+
+        return error;
+    }
+
+    ctx->dirty_pending = pending;
+    ctx->dirty_syncing = 1;
+
+    return EAGAIN;
+}
+
+int32_t heal_dirty_check(xlator_t * xl, inode_t * inode, uint64_t start, uint64_t end, void ** data, uint32_t * length)
+{
+    heal_inode_ctx_t * ctx;
+    int32_t error;
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if (error == 0)
+    {
+        error = __heal_dirty_check(xl, ctx, start, end, data, length);
+    }
+
+    UNLOCK(&inode->lock);
+
+    return error;
+}
+
+/* Loads the journal of the active generation returned by lookup, unless
+ * the context already has it. */
+void __heal_dirty_load(xlator_t * xl, heal_inode_ctx_t * ctx, dict_t * xdata)
+{
+    heal_private_t * priv;
+    heal_ranges_t dirty;
+    data_t * data;
+    uint64_t gen;
+
+    priv = xl->private;
+    if ((priv->dirty_gen == 0) || (ctx->dirty_gen == priv->dirty_gen) || (ctx->dirty_syncing != 0))
+    {
+        return;
+    }
+
+    heal_ranges_clear(&ctx->dirty);
+    ctx->dirty_gen = priv->dirty_gen;
+
+    data = (xdata != NULL) ? dict_get(xdata, HEAL_KEY_DIRTY) : NULL;
+    if (data != NULL)
+    {
+        heal_ranges_init(&dirty);
+        if (heal_ranges_decode(&dirty, data->data, data->len, &gen) == 0)
+        {
+            if (gen == priv->dirty_gen)
+            {
+                ctx->dirty = dirty;
+            }
+            else
+            {
+                heal_ranges_clear(&dirty);
+            }
+        }
+    }
+}
+
+void heal_dirty_fail_writev(call_stub_t * stub, int32_t error)
+{
+    STACK_UNWIND_STRICT(writev, stub->frame, -1, error, NULL, NULL, NULL);
+    call_stub_destroy(stub);
+}
+
+void heal_dirty_fail_truncate(call_stub_t * stub, int32_t error)
+{
+    STACK_UNWIND_STRICT(truncate, stub->frame, -1, error, NULL, NULL, NULL);
+    call_stub_destroy(stub);
+}
+
+void heal_dirty_fail_ftruncate(call_stub_t * stub, int32_t error)
+{
+    STACK_UNWIND_STRICT(ftruncate, stub->frame, -1, error, NULL, NULL, NULL);
+    call_stub_destroy(stub);
+}
+
+/* Fails a request that was waiting for the journal to be stored. */
+void heal_dirty_fail(call_stub_t * stub, int32_t error)
+{
+    switch (stub->fop)
+    {
+        case GF_FOP_WRITE:
+            heal_dirty_fail_writev(stub, error);
+            break;
+        case GF_FOP_TRUNCATE:
+            heal_dirty_fail_truncate(stub, error);
+            break;
+        case GF_FOP_FTRUNCATE:
+            heal_dirty_fail_ftruncate(stub, error);
+            break;
+        default:
+            call_resume(stub);
+    }
+}
+
+/* Ends the store of the journal. If it has failed, the new ranges are
+ * discarded and the requests waiting for it fail too. */
+void heal_dirty_stored(xlator_t * xl, inode_t * inode, int32_t error)
+{
+    struct list_head stubs;
+    heal_inode_ctx_t * ctx;
+    call_stub_t * stub, * tmp;
+
+    INIT_LIST_HEAD(&stubs);
+
+    LOCK(&inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, inode) == 0)
+    {
+        if (error == 0)
+        {
+            heal_ranges_clear(&ctx->dirty);
+            ctx->dirty = ctx->dirty_pending;
+            heal_ranges_init(&ctx->dirty_pending);
+        }
+        else
+        {
+            heal_ranges_clear(&ctx->dirty_pending);
+        }
+        ctx->dirty_syncing = 0;
+        list_splice_init(&ctx->dirty_stubs, &stubs);
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (error == 0)
+    {
+        heal_stubs_resume(&stubs);
+    }
+    else
+    {
+        list_for_each_entry_safe(stub, tmp, &stubs, list)
+        {
+            list_del_init(&stub->list);
+            heal_dirty_fail(stub, error);
+        }
+    }
+}
+
+int32_t heal_dirty_store_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    heal_dirty_local_t * local;
+
+    local = cookie;
+
+    heal_dirty_stored(xl, local->inode, (result < 0) ? code : 0);
+
+    if (result < 0)
+    {
+        gf_log(xl->name, GF_LOG_ERROR, "Unable to store the dirty region journal of %s (error=%d)", uuid_utoa(local->inode->gfid), code);
+
+        local->fail(local->stub, code);
+    }
+    else
+    {
+        call_resume(local->stub);
+    }
+
+    inode_unref(local->inode);
+    GF_FREE(local);
+
+    return 0;
+}
+
+/* Stores the journal and then resumes the request that has modified it.
+ * If the request is not a heal write, other requests that are waiting
+ * will be resumed once the journal has been stored. */
+int32_t heal_dirty_store(call_frame_t * frame, xlator_t * xl, inode_t * inode, loc_t * loc, fd_t * fd, void * data, uint32_t length, call_stub_t * stub, void (* fail)(call_stub_t *, int32_t))
+{
+    heal_dirty_local_t * local;
+    dict_t * dict;
+
+    local = NULL;
+    dict = NULL;
+    if (stub == NULL)
+    {
+        goto failed;
+    }
+    local = GF_MALLOC(sizeof(heal_dirty_local_t), gf_heal_mt_heal_dirty_local_t);
+    if (local == NULL)
+    {
+        goto failed;
+    }
+    dict = dict_new();
+    if (dict == NULL)
+    {
+        goto failed;
+    }
+    if (dict_set_bin(dict, HEAL_KEY_DIRTY, data, length) != 0)
+    {
+        dict_unref(dict);
+        dict = NULL;
+
+        goto failed;
+    }
+
+    local->inode = inode_ref(inode);
+    local->stub = stub;
+    local->fail = fail;
+
+    if (fd != NULL)
+    {
+        STACK_WIND_COOKIE(frame, heal_dirty_store_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fsetxattr, fd, dict, 0, NULL);
+    }
+    else
+    {
+        STACK_WIND_COOKIE(frame, heal_dirty_store_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->setxattr, loc, dict, 0, NULL);
+    }
+
+    dict_unref(dict);
+
+    return 0;
+
+failed:
+    GF_FREE(data);
+    GF_FREE(local);
+    if (stub != NULL)
+    {
+        call_stub_destroy(stub);
+    }
+
+    heal_dirty_stored(xl, inode, ENOMEM);
+
+    return ENOMEM;
+}
+
+int32_t heal_dirty_queue(xlator_t * xl, inode_t * inode, call_stub_t * stub)
+{
+    heal_inode_ctx_t * ctx;
+
+    if (stub == NULL)
+    {
+        return ENOMEM;
+    }
+
+    LOCK(&inode->lock);
+
+    if ((__heal_inode_ctx_get(&ctx, xl, inode) == 0) && (ctx->dirty_syncing != 0))
+    {
+        list_add_tail(&stub->list, &ctx->dirty_stubs);
+        stub = NULL;
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (stub != NULL)
+    {
+        call_resume(stub);
+    }
+
+    return 0;
+}
+
+/* Handles the result of heal_dirty_check() when the request can't be sent
+ * immediately. */
+int32_t heal_dirty_defer(call_frame_t * frame, xlator_t * xl, inode_t * inode, loc_t * loc, fd_t * fd, int32_t action, void * data, uint32_t length, call_stub_t * stub, void (* fail)(call_stub_t *, int32_t))
+{
+    if (action == EINPROGRESS)
+    {
+        return heal_dirty_queue(xl, inode, stub);
+    }
+
+    return heal_dirty_store(frame, xl, inode, loc, fd, data, length, stub, fail);
+}
+
+int32_t heal_dirty_getxattr(xlator_t * xl, inode_t * inode, dict_t ** dict)
+{
+    heal_private_t * priv;
+    heal_inode_ctx_t * ctx;
+    void * data;
+    uint32_t length;
+    int32_t error;
+
+    priv = xl->private;
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if (error == 0)
+    {
+        if (ctx->dirty_gen != priv->dirty_gen)
+        {
+            heal_ranges_clear(&ctx->dirty);
+            ctx->dirty_gen = priv->dirty_gen;
+        }
+        error = heal_ranges_encode(&ctx->dirty, ctx->dirty_gen, &data, &length);
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (error != 0)
+    {
+        return error;
+    }
+
+    *dict = dict_new();
+    if ((*dict == NULL) || (dict_set_bin(*dict, HEAL_KEY_DIRTY, data, length) != 0))
+    {
+        if (*dict != NULL)
+        {
+            dict_unref(*dict);
+        }
+        GF_FREE(data);
+
+        return ENOMEM;
+    }
+
+    return 0;
+}
+
+void heal_dirty_gen_load(xlator_t * xl, dict_t * xdata)
+{
+    heal_private_t * priv;
+    uint64_t gen;
+
+    priv = xl->private;
+    if (!priv->dirty_loaded)
+    {
+        if ((xdata != NULL) && (heal_dict_get_uint64(xdata, HEAL_KEY_DIRTY_GEN, &gen) == 0))
+        {
+            priv->dirty_gen = gen;
+        }
+        priv->dirty_loaded = 1;
+    }
+}
+
+int32_t heal_dirty_gen_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    heal_private_t * priv;
+    uint64_t * gen;
+
+    priv = xl->private;
+    gen = cookie;
+    if (result >= 0)
+    {
+        priv->dirty_gen = *gen;
+        priv->dirty_loaded = 1;
+
+        gf_log(xl->name, GF_LOG_INFO, "Dirty region journal generation set to %lu", *gen);
+    }
+    GF_FREE(gen);
+
+    STACK_UNWIND_STRICT(setxattr, frame, result, code, xdata);
+
+    return 0;
+}
+
+/* Activates (or deactivates if 0) a new generation of the dirty region
+ * journal. The generation is stored as an xattr of the brick root. */
+int32_t heal_dirty_gen_set(call_frame_t * frame, xlator_t * xl, loc_t * loc, dict_t * dict, int32_t flags, dict_t * xdata)
+{
+    uint64_t * gen;
+
+    if (!heal_loc_is_root(loc))
+    {
+        return EINVAL;
+    }
+
+    gen = GF_MALLOC(sizeof(uint64_t), gf_heal_mt_uint8_t);
+    if (gen == NULL)
+    {
+        return ENOMEM;
+    }
+    if (heal_dict_get_uint64(dict, HEAL_KEY_DIRTY_GEN, gen) != 0)
+    {
+        GF_FREE(gen);
+
+        return EINVAL;
+    }
+
+    STACK_WIND_COOKIE(frame, heal_dirty_gen_cbk, gen, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->setxattr, loc, dict, flags, xdata);
+
+    return 0;
+}
+
+/* Returns a page of the registry of active heals. The name of the xattr
+ * can be followed by ':' and the cursor returned by the previous page. */
+int32_t heal_active_getxattr(xlator_t * xl, loc_t * loc, const char * name, dict_t ** dict)
+{
+    heal_private_t * priv;
+    uint64_t cursor;
+    void * data;
+    uint32_t length;
+    const char * arg;
+    char * end;
+    int32_t error;
+
+    priv = xl->private;
+    if (!heal_loc_is_root(loc))
+    {
+        return ENODATA;
+    }
+
+    cursor = 0;
+    arg = name + sizeof(HEAL_KEY_ACTIVE) - 1;
+    if (*arg == ':')
+    {
+        cursor = strtoull(arg + 1, &end, 10);
+        if ((end == arg + 1) || (*end != 0))
+        {
+            return EINVAL;
+        }
+    }
+    else if (*arg != 0)
+    {
+        return ENODATA;
+    }
+
+    error = heal_registry_list(&priv->registry, cursor, &data, &length);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    *dict = dict_new();
+    // The reply must use the requested name as the key.
+    if ((*dict == NULL) || (dict_set_bin(*dict, (char *)name, data, length) != 0))
+    {
+        if (*dict != NULL)
+        {
+            dict_unref(*dict);
+        }
+        GF_FREE(data);
+
+        return ENOMEM;
+    }
+
+    return 0;
+}
+
+/* Returns the counters of the translator as text. */
+int32_t heal_stats_getxattr(xlator_t * xl, loc_t * loc, dict_t ** dict)
+{
+    heal_private_t * priv;
+    heal_compress_stats_t * stats;
+    char * text;
+
+    priv = xl->private;
+    if (!heal_loc_is_root(loc))
+    {
+        return ENODATA;
+    }
+
+    text = GF_MALLOC(HEAL_STATS_SIZE, gf_heal_mt_uint8_t);
+    if (text == NULL)
+    {
+        return ENOMEM;
+    }
+
+    stats = &priv->compress;
+    snprintf(text, HEAL_STATS_SIZE,
+             "active=%lu\n"
+             "check.skipped=%lu\n"
+             "check.skipped-bytes=%lu\n"
+             "compress.writes=%lu\n"
+             "compress.errors=%lu\n"
+             "compress.compressed-bytes=%lu\n"
+             "compress.decompressed-bytes=%lu\n"
+             "compress.decode-usecs=%lu\n"
+             "stream.reads=%lu\n"
+             "stream.waits=%lu\n"
+             "stream.bytes=%lu\n"
+             "stream.readahead-bytes=%lu\n"
+             "granularity.unaligned-writes=%lu\n"
+             "granularity.unaligned-bytes=%lu\n"
+             "granularity.conflicts=%lu\n",
+             priv->registry.count, priv->check_skipped,
+             priv->check_skipped_bytes, stats->writes, stats->errors,
+             stats->compressed, stats->decompressed, stats->usecs,
+             priv->stream_reads, priv->stream_waits, priv->stream_bytes,
+             priv->stream_readahead, priv->unaligned_writes,
+             priv->unaligned_bytes, priv->unaligned_conflicts);
+
+    *dict = dict_new();
+    if ((*dict == NULL) || (dict_set_dynstr(*dict, HEAL_KEY_STATS, text) != 0))
+    {
+        if (*dict != NULL)
+        {
+            dict_unref(*dict);
+        }
+        GF_FREE(text);
+
+        return ENOMEM;
+    }
+
+    return 0;
+}
+
+/* Returns the hottest inodes of the brick. The maximum number of inodes
+ * can be given by appending ":<count>" to the name. */
+int32_t heal_heat_getxattr(xlator_t * xl, loc_t * loc, const char * name, dict_t ** dict)
+{
+    heal_private_t * priv;
+    uint64_t limit;
+    void * data;
+    uint32_t length;
+    const char * arg;
+    char * end;
+    int32_t error;
+
+    priv = xl->private;
+    if (!heal_loc_is_root(loc))
+    {
+        return ENODATA;
+    }
+
+    limit = 0;
+    arg = name + sizeof(HEAL_KEY_HEAT) - 1;
+    if (*arg == ':')
+    {
+        limit = strtoull(arg + 1, &end, 10);
+        if ((end == arg + 1) || (*end != 0) || (limit > UINT32_MAX))
+        {
+            return EINVAL;
+        }
+    }
+    else if (*arg != 0)
+    {
+        return ENODATA;
+    }
+
+    error = heal_heat_collect(&priv->heat, limit, &data, &length);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    *dict = dict_new();
+    if ((*dict == NULL) || (dict_set_bin(*dict, (char *)name, data, length) != 0))
+    {
+        if (*dict != NULL)
+        {
+            dict_unref(*dict);
+        }
+        GF_FREE(data);
+
+        return ENOMEM;
+    }
+
+    return 0;
+}
+
+/* Returns all the events stored in the trace rings. */
+int32_t heal_trace_getxattr(xlator_t * xl, loc_t * loc, dict_t ** dict)
+{
+    void * data;
+    uint32_t length;
+    int32_t error;
+
+    if (!heal_loc_is_root(loc))
+    {
+        return ENODATA;
+    }
+
+    error = heal_trace_collect(&data, &length);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    *dict = dict_new();
+    if ((*dict == NULL) || (dict_set_bin(*dict, HEAL_KEY_TRACE, data, length) != 0))
+    {
+        if (*dict != NULL)
+        {
+            dict_unref(*dict);
+        }
+        GF_FREE(data);
+
+        return ENOMEM;
+    }
+
+    return 0;
+}
+
+int32_t heal_access(call_frame_t * frame, xlator_t * xl, loc_t * loc, int32_t mask, dict_t * xdata)
+{
+    dict_t * reply;
+    int32_t error;
+
+    error = heal_inode_ctx_check(xl, loc->inode, &reply);
+    if (error == 0)
+    {
+        STACK_WIND(frame, default_access_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->access, loc, mask, xdata);
+
+        return 0;
+    }
+
+    STACK_UNWIND_STRICT(access, frame, -1, error, reply);
+
+    if (reply != NULL)
+    {
+        dict_unref(reply);
+    }
+
+    return 0;
+}
+
+int32_t heal_create_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, fd_t * fd, inode_t * inode, struct iatt * attr, struct iatt * attr_ppre, struct iatt * attr_ppost, dict_t * xdata)
+{
+    inode_t * base;
+    heal_fd_ctx_t * fd_ctx;
+    int32_t error;
+
+    base = cookie;
+    if (base != NULL)
+    {
+        if ((result < 0) || (inode != base))
+        {
+            gf_log(xl->name, GF_LOG_WARNING, "inode changed in create");
+
+            heal_inode_clear_healing(xl, base, 0);
+        }
+        if (result >= 0)
+        {
+            error = heal_fd_ctx_new(&fd_ctx, xl, fd);
+            if (error != 0)
+            {
+                code = error;
+                result = -1;
+            }
+            else
+            {
+                fd_ctx->healing = 1;
+                fd_ctx->lease = heal_inode_register(xl, base, attr->ia_gfid, frame);
+            }
+        }
+    }
+
+    STACK_UNWIND_STRICT(create, frame, result, code, fd, inode, attr, attr_ppre, attr_ppost, xdata);
+
+    if (base != NULL)
+    {
+        inode_unref(base);
+    }
+
+    return 0;
+}
+
+void heal_create_inline_free(heal_inline_local_t * local)
+{
+    if (local->fd != NULL)
+    {
+        fd_unref(local->fd);
+    }
+    if (local->xattrs != NULL)
+    {
+        dict_unref(local->xattrs);
+    }
+    if (local->reply != NULL)
+    {
+        dict_unref(local->reply);
+    }
+    if (local->iobref != NULL)
+    {
+        iobref_unref(local->iobref);
+    }
+    dict_unref(local->xdata);
+    inode_unref(local->inode);
+    GF_FREE(local);
+}
+
+/* The file is left as it is. Since it's not in heal mode anymore, the
+ * healer will need to heal it again. */
+int32_t heal_create_inline_fail(call_frame_t * frame, xlator_t * xl, heal_inline_local_t * local, int32_t error)
+{
+    gf_log(xl->name, GF_LOG_WARNING, "Inline heal of %s failed (error=%d)", uuid_utoa(local->inode->gfid), error);
+
+    heal_inode_clear_healing(xl, local->inode, local->lease);
+
+    STACK_UNWIND_STRICT(create, frame, -1, error, NULL, NULL, NULL, NULL, NULL, NULL);
+
+    heal_create_inline_free(local);
+
+    return 0;
+}
+
+int32_t heal_create_inline_stat_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr, dict_t * xdata)
+{
+    heal_inline_local_t * local;
+    heal_fd_ctx_t * fd_ctx;
+
+    local = cookie;
+
+    heal_inode_clear_healing(xl, local->inode, local->lease);
+    // The fd returned to the healer can be used as a normal fd from now on.
+    if (heal_fd_ctx_get(&fd_ctx, xl, local->fd) == 0)
+    {
+        fd_ctx->healing = 0;
+    }
+
+    STACK_UNWIND_STRICT(create, frame, 0, 0, local->fd, local->inode, (result >= 0) ? attr : &local->attr, &local->attr_ppre, &local->attr_ppost, local->reply);
+
+    heal_create_inline_free(local);
+
+    return 0;
+}
+
+void heal_create_inline_done(call_frame_t * frame, xlator_t * xl, heal_inline_local_t * local, int32_t error)
+{
+    if (error != 0)
+    {
+        heal_create_inline_fail(frame, xl, local, error);
+
+        return;
+    }
+
+    STACK_WIND_COOKIE(frame, heal_create_inline_stat_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fstat, local->fd, NULL);
+}
+
+/* Applies the xattrs and attributes of an inline heal using the same
+ * steps as a metadata heal. */
+int32_t heal_create_inline_meta(call_frame_t * frame, xlator_t * xl, heal_inline_local_t * local)
+{
+    heal_meta_local_t * meta;
+    heal_inode_ctx_t * ctx;
+    int32_t error;
+
+    meta = GF_MALLOC(sizeof(heal_meta_local_t), gf_heal_mt_heal_meta_local_t);
+    if (meta == NULL)
+    {
+        return heal_create_inline_fail(frame, xl, local, ENOMEM);
+    }
+    meta->inode = local->inode;
+    meta->loc = NULL;
+    meta->fd = local->fd;
+    meta->xattrs = local->xattrs;
+    meta->flags = 0;
+    meta->valid = 0;
+    meta->remove = NULL;
+    meta->remove_size = 0;
+    meta->step = HEAL_META_XATTRS;
+    meta->owner = local;
+
+    error = heal_meta_decode(meta, local->xdata);
+    if (error == 0)
+    {
+        LOCK(&local->inode->lock);
+
+        error = __heal_inode_ctx_get(&ctx, xl, local->inode);
+        if (error == 0)
+        {
+            // All the data has been written.
+            ctx->offset = ctx->size;
+            if (ctx->meta_healing != 0)
+            {
+                error = EBUSY;
+            }
+            else
+            {
+                ctx->meta_healing = 1;
+            }
+        }
+
+        UNLOCK(&local->inode->lock);
+    }
+    if (error != 0)
+    {
+        GF_FREE(meta);
+
+        return heal_create_inline_fail(frame, xl, local, error);
+    }
+
+    inode_ref(local->inode);
+
+    heal_meta_next(frame, xl, meta);
+
+    return 0;
+}
+
+int32_t heal_create_inline_write_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    heal_inline_local_t * local;
+
+    local = cookie;
+    if (result < 0)
+    {
+        return heal_create_inline_fail(frame, xl, local, code);
+    }
+    if (result != local->vector.iov_len)
+    {
+        return heal_create_inline_fail(frame, xl, local, EIO);
+    }
+
+    return heal_create_inline_meta(frame, xl, local);
+}
+
+int32_t heal_create_inline_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, fd_t * fd, inode_t * inode, struct iatt * attr, struct iatt * attr_ppre, struct iatt * attr_ppost, dict_t * xdata)
+{
+    heal_inline_local_t * local;
+    heal_fd_ctx_t * fd_ctx;
+    int32_t error;
+
+    local = cookie;
+    if (result < 0)
+    {
+        return heal_create_inline_fail(frame, xl, local, code);
+    }
+    if (inode != local->inode)
+    {
+        return heal_create_inline_fail(frame, xl, local, EIO);
+    }
+
+    error = heal_fd_ctx_new(&fd_ctx, xl, fd);
+    if (error != 0)
+    {
+        return heal_create_inline_fail(frame, xl, local, error);
+    }
+    fd_ctx->healing = 1;
+    fd_ctx->lease = heal_inode_register(xl, inode, attr->ia_gfid, frame);
+
+    local->fd = fd_ref(fd);
+    local->lease = fd_ctx->lease;
+    local->attr = *attr;
+    local->attr_ppre = *attr_ppre;
+    local->attr_ppost = *attr_ppost;
+    local->reply = (xdata != NULL) ? dict_ref(xdata) : NULL;
+
+    if (local->vector.iov_len == 0)
+    {
+        return heal_create_inline_meta(frame, xl, local);
+    }
+
+    STACK_WIND_COOKIE(frame, heal_create_inline_write_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->writev, fd, &local->vector, 1, 0, 0, local->iobref, NULL);
+
+    return 0;
+}
+
+/* Prepares a heal create that contains the whole file: its data, xattrs
+ * and attributes. Everything is applied before answering the create. */
+int32_t heal_create_inline_prepare(xlator_t * xl, inode_t * inode, dict_t * xdata, uint64_t size, heal_inline_local_t ** local)
+{
+    heal_private_t * priv;
+    data_t * data, * xattrs;
+
+    priv = xl->private;
+
+    data = dict_get(xdata, HEAL_KEY_DATA);
+    if ((size > priv->inline_size) || ((data == NULL) && (size != 0)) || ((data != NULL) && (data->len != size)))
+    {
+        return EINVAL;
+    }
+
+    *local = GF_MALLOC(sizeof(heal_inline_local_t), gf_heal_mt_heal_inline_local_t);
+    if (*local == NULL)
+    {
+        return ENOMEM;
+    }
+    (*local)->fd = NULL;
+    (*local)->xattrs = NULL;
+    (*local)->reply = NULL;
+    (*local)->lease = 0;
+    (*local)->vector.iov_base = (data != NULL) ? data->data : NULL;
+    (*local)->vector.iov_len = size;
+    (*local)->iobref = iobref_new();
+    if ((*local)->iobref == NULL)
+    {
+        GF_FREE(*local);
+
+        return ENOMEM;
+    }
+
+    xattrs = dict_get(xdata, HEAL_KEY_XATTRS);
+    if (xattrs != NULL)
+    {
+        (*local)->xattrs = dict_new();
+        if (((*local)->xattrs == NULL) || (dict_unserialize(xattrs->data, xattrs->len, &(*local)->xattrs) != 0))
+        {
+            if ((*local)->xattrs != NULL)
+            {
+                dict_unref((*local)->xattrs);
+            }
+            iobref_unref((*local)->iobref);
+            GF_FREE(*local);
+
+            return EINVAL;
+        }
+    }
+
+    (*local)->xdata = dict_ref(xdata);
+    (*local)->inode = inode_ref(inode);
+
+    return 0;
+}
+
+int32_t heal_create(call_frame_t * frame, xlator_t * xl, loc_t * loc, int32_t flags, mode_t mode, mode_t umask, fd_t * fd, dict_t * xdata)
+{
+    heal_inode_ctx_t * ctx;
+    heal_inline_local_t * local;
+    uint64_t size;
+    uint32_t value;
+    int32_t healing, error;
+
+    error = 0;
+    healing = 0;
+    size = 0;
+    local = NULL;
+    if (xdata != NULL)
+    {
+        if (heal_dict_get_uint32(xdata, HEAL_KEY_FLAGS, &value) == 0)
+        {
+            if (value != 0)
+            {
+                if (heal_dict_get_uint64(xdata, HEAL_KEY_SIZE, &size) == 0)
+                {
+                    healing = 1;
+                    if ((value & HEAL_FLAG_INLINE) != 0)
+                    {
+                        error = heal_create_inline_prepare(xl, loc->inode, xdata, size, &local);
+                    }
+                }
+                else
+                {
+                    error = EIO;
+                }
+            }
+        }
+    }
+    if (error == 0)
+    {
+        error = heal_inode_ctx_new(&ctx, xl, loc->inode, healing, size);
+        if ((error == 0) && healing && (local == NULL) && ((value & HEAL_FLAG_JOURNAL) != 0))
+        {
+            LOCK(&loc->inode->lock);
+            ctx->journal = 1;
+            UNLOCK(&loc->inode->lock);
+        }
+        if ((error == 0) && (local != NULL))
+        {
+            // posix would try to store the contents of the file as xattrs.
+            xdata = dict_ref(xdata);
+            if ((heal_dict_del_cow(&xdata, HEAL_KEY_DATA) == 0) && (heal_dict_del_cow(&xdata, HEAL_KEY_XATTRS) == 0))
+            {
+                STACK_WIND_COOKIE(frame, heal_create_inline_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->create, loc, flags, mode, umask, fd, xdata);
+
+                dict_unref(xdata);
+
+                return 0;
+            }
+            dict_unref(xdata);
+
+            heal_inode_clear_healing(xl, loc->inode, 0);
+
+            error = ENOMEM;
+        }
+        if (error == 0)
+        {
+            if (healing)
+            {
+                heal_inode_map_init(xl, loc->inode, size);
+            }
+
+            STACK_WIND_COOKIE(frame, heal_create_cbk, healing ? inode_ref(loc->inode) : NULL, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->create, loc, flags, mode, umask, fd, xdata);
+
+            return 0;
+        }
+    }
+
+    if (local != NULL)
+    {
+        heal_create_inline_free(local);
+    }
+
+    STACK_UNWIND_STRICT(create, frame, -1, error, NULL, NULL, NULL, NULL, NULL, NULL);
+
+    return 0;
+}
+
+int32_t heal_fingerprint_reply(call_frame_t * frame, const char * name, uint8_t * digest)
+{
+    dict_t * dict;
+    void * data;
+
+    data = GF_MALLOC(HEAL_CHECKSUM_SIZE, gf_heal_mt_uint8_t);
+    if (data == NULL)
+    {
+        return ENOMEM;
+    }
+    memcpy(data, digest, HEAL_CHECKSUM_SIZE);
+
+    dict = dict_new();
+    // The reply must use the requested name as the key.
+    if ((dict == NULL) || (dict_set_bin(dict, (char *)name, data, HEAL_CHECKSUM_SIZE) != 0))
+    {
+        if (dict != NULL)
+        {
+            dict_unref(dict);
+        }
+        GF_FREE(data);
+
+        return ENOMEM;
+    }
+
+    STACK_UNWIND_STRICT(getxattr, frame, 0, 0, dict, NULL);
+
+    dict_unref(dict);
+
+    return 0;
+}
+
+void heal_fingerprint_free(heal_fingerprint_local_t * local)
+{
+    inode_unref(local->inode);
+    GF_FREE(local->name);
+    GF_FREE(local);
+}
+
+int32_t heal_fingerprint_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * dict, dict_t * xdata)
+{
+    heal_fingerprint_local_t * local;
+    heal_inode_ctx_t * ctx;
+    uint8_t digest[HEAL_CHECKSUM_SIZE];
+    const char * prefix;
+    int32_t error;
+
+    local = cookie;
+
+    if (result < 0)
+    {
+        error = code;
+
+        goto failed;
+    }
+
+    prefix = local->name + sizeof(HEAL_KEY_FINGERPRINT) - 1;
+    prefix = (*prefix == ':') ? prefix + 1 : NULL;
+
+    error = heal_dict_fingerprint(dict, prefix, HEAL_KEY_PREFIX, digest);
+    if (error != 0)
+    {
+        goto failed;
+    }
+
+    // Only the fingerprint of all xattrs is cached, and only if no xattr
+    // has been modified while it was being computed.
+    if ((prefix == NULL) && local->cacheable)
+    {
+        LOCK(&local->inode->lock);
+
+        if ((__heal_inode_ctx_get(&ctx, xl, local->inode) == 0) && (ctx->version == local->version))
+        {
+            memcpy(ctx->fingerprint, digest, HEAL_CHECKSUM_SIZE);
+            ctx->fingerprint_version = local->version;
+            ctx->fingerprint_valid = 1;
+        }
+
+        UNLOCK(&local->inode->lock);
+    }
+
+    error = heal_fingerprint_reply(frame, local->name, digest);
+    if (error != 0)
+    {
+        goto failed;
+    }
+
+    heal_fingerprint_free(local);
+
+    return 0;
+
+failed:
+    STACK_UNWIND_STRICT(getxattr, frame, -1, error, NULL, NULL);
+
+    heal_fingerprint_free(local);
+
+    return 0;
+}
+
+/* Returns an order independent hash of all the xattrs of the inode. Only
+ * the xattrs starting by a prefix are included if it's appended to the name
+ * as ":<prefix>". The hash of all the xattrs is cached in the inode until
+ * any of them is modified (which changes the metadata version). */
+int32_t heal_fingerprint_getxattr(call_frame_t * frame, xlator_t * xl, loc_t * loc, const char * name, dict_t * xdata)
+{
+    heal_fingerprint_local_t * local;
+    heal_inode_ctx_t * ctx;
+    uint8_t digest[HEAL_CHECKSUM_SIZE];
+    uint64_t version;
+    int32_t error, cached, cacheable;
+
+    cached = 0;
+    cacheable = 0;
+    version = 0;
+
+    LOCK(&loc->inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, loc->inode) == 0)
+    {
+        if (ctx->fingerprint_valid && (ctx->fingerprint_version == ctx->version))
+        {
+            memcpy(digest, ctx->fingerprint, HEAL_CHECKSUM_SIZE);
+            cached = 1;
+        }
+        version = ctx->version;
+        cacheable = (ctx->meta_pending == 0) && (ctx->meta_healing == 0);
+    }
+
+    UNLOCK(&loc->inode->lock);
+
+    if (cached && (name[sizeof(HEAL_KEY_FINGERPRINT) - 1] == 0))
+    {
+        error = heal_fingerprint_reply(frame, name, digest);
+        if (error == 0)
+        {
+            return 0;
+        }
+
+        goto failed;
+    }
+
+    local = GF_MALLOC(sizeof(heal_fingerprint_local_t), gf_heal_mt_heal_fingerprint_local_t);
+    if (local == NULL)
+    {
+        error = ENOMEM;
+
+        goto failed;
+    }
+    local->name = gf_strdup(name);
+    if (local->name == NULL)
+    {
+        GF_FREE(local);
+
+        error = ENOMEM;
+
+        goto failed;
+    }
+    local->inode = inode_ref(loc->inode);
+    local->version = version;
+    local->cacheable = cacheable;
+
+    STACK_WIND_COOKIE(frame, heal_fingerprint_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->getxattr, loc, NULL, xdata);
+
+    return 0;
+
+failed:
+    STACK_UNWIND_STRICT(getxattr, frame, -1, error, NULL, NULL);
+
+    return 0;
+}
+
+int32_t heal_getxattr(call_frame_t * frame, xlator_t * xl, loc_t * loc, const char * name, dict_t * xdata)
+{
+    heal_private_t * priv;
+    dict_t * dict, * reply;
+    int32_t error;
+
+    priv = xl->private;
+    if ((name != NULL) && ((strncmp(name, HEAL_KEY_ACTIVE, sizeof(HEAL_KEY_ACTIVE) - 1) == 0) || (strcmp(name, HEAL_KEY_STATS) == 0) || (strcmp(name, HEAL_KEY_TRACE) == 0) ||
+                           (strncmp(name, HEAL_KEY_HEAT, sizeof(HEAL_KEY_HEAT) - 1) == 0)))
+    {
+        if (strcmp(name, HEAL_KEY_STATS) == 0)
+        {
+            error = heal_stats_getxattr(xl, loc, &dict);
+        }
+        else if (strcmp(name, HEAL_KEY_TRACE) == 0)
+        {
+            error = heal_trace_getxattr(xl, loc, &dict);
+        }
+        else if (strncmp(name, HEAL_KEY_HEAT, sizeof(HEAL_KEY_HEAT) - 1) == 0)
+        {
+            error = heal_heat_getxattr(xl, loc, name, &dict);
+        }
+        else
+        {
+            error = heal_active_getxattr(xl, loc, name, &dict);
+        }
+        if (error == 0)
+        {
+            STACK_UNWIND_STRICT(getxattr, frame, 0, 0, dict, NULL);
+
+            dict_unref(dict);
+
+            return 0;
+        }
+
+        STACK_UNWIND_STRICT(getxattr, frame, -1, error, NULL, NULL);
+
+        return 0;
+    }
+    if ((name != NULL) && (priv->dirty_gen != 0) && (strcmp(name, HEAL_KEY_DIRTY) == 0))
+    {
+        error = heal_dirty_getxattr(xl, loc->inode, &dict);
+        if (error == 0)
+        {
+            STACK_UNWIND_STRICT(getxattr, frame, 0, 0, dict, NULL);
+
+            dict_unref(dict);
+
+            return 0;
+        }
+
+        STACK_UNWIND_STRICT(getxattr, frame, -1, error, NULL, NULL);
+
+        return 0;
+    }
+
+    error = heal_inode_ctx_check(xl, loc->inode, &reply);
+    if (error == 0)
+    {
+        if ((name != NULL) && (strncmp(name, HEAL_KEY_FINGERPRINT, sizeof(HEAL_KEY_FINGERPRINT) - 1) == 0))
+        {
+            return heal_fingerprint_getxattr(frame, xl, loc, name, xdata);
+        }
+
+        STACK_WIND(frame, default_getxattr_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->getxattr, loc, name, xdata);
+
+        return 0;
+    }
+
+    STACK_UNWIND_STRICT(getxattr, frame, -1, error, NULL, reply);
+
+    if (reply != NULL)
+    {
+        dict_unref(reply);
+    }
+
+    return 0;
+}
+
+int32_t heal_fgetxattr(call_frame_t * frame, xlator_t * xl, fd_t * fd, const char * name, dict_t * xdata)
+{
+    heal_private_t * priv;
+    dict_t * dict, * reply;
+    int32_t error;
+
+    priv = xl->private;
+    if ((name != NULL) && (priv->dirty_gen != 0) && (strcmp(name, HEAL_KEY_DIRTY) == 0))
+    {
+        error = heal_dirty_getxattr(xl, fd->inode, &dict);
+        if (error == 0)
+        {
+            STACK_UNWIND_STRICT(fgetxattr, frame, 0, 0, dict, NULL);
+
+            dict_unref(dict);
+
+            return 0;
+        }
+
+        STACK_UNWIND_STRICT(fgetxattr, frame, -1, error, NULL, NULL);
+
+        return 0;
+    }
+
+    error = heal_inode_ctx_check(xl, fd->inode, &reply);
+    if (error == 0)
+    {
+        STACK_WIND(frame, default_fgetxattr_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fgetxattr, fd, name, xdata);
+
+        return 0;
+    }
+
+    STACK_UNWIND_STRICT(fgetxattr, frame, -1, error, NULL, reply);
+
+    if (reply != NULL)
+    {
+        dict_unref(reply);
+    }
+
+    return 0;
+}
+
+void __heal_state_encode(heal_inode_ctx_t * ctx, heal_state_t * state)
+{
+    uint32_t flags;
+
+    flags = 0;
+    if (ctx->healing != 0)
+    {
+        flags |= HEAL_STATE_HEALING;
+    }
+    if (ctx->aborted != 0)
+    {
+        flags |= HEAL_STATE_ABORTED;
+    }
+    state->flags = hton32(flags);
+    state->offset = hton64(ctx->offset);
+    state->size = hton64(ctx->size);
+}
+
+/* Adds the heal state of 'inode' to 'xdata'. */
+int32_t heal_state_set(xlator_t * xl, inode_t * inode, dict_t ** xdata)
+{
+    heal_inode_ctx_t * ctx;
+    heal_state_t * state;
+    int32_t error;
+
+    // The dict takes the ownership of the state.
+    state = GF_MALLOC(sizeof(heal_state_t), gf_heal_mt_uint8_t);
+    if (state == NULL)
+    {
+        return ENOMEM;
+    }
+
+    LOCK(&inode->lock);
+
+    error = __heal_inode_ctx_get(&ctx, xl, inode);
+    if (error == 0)
+    {
+        __heal_state_encode(ctx, state);
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (error == 0)
+    {
+        error = heal_dict_set_bin_cow(xdata, HEAL_KEY_STATE, state, sizeof(heal_state_t));
+    }
+    if (error != 0)
+    {
+        GF_FREE(state);
+    }
+
+    return error;
+}
+
+/* Starts the reservation of a new batch of content generations if the
+ * counter is getting close to the last reserved value. Returns the value
+ * to store, or 0 if nothing needs to be stored. */
+uint64_t __heal_generation_reserve(heal_inode_ctx_t * ctx)
+{
+    // Half of the batch is still available when the next one is requested,
+    // so that it's normally stored before any generation beyond the stored
+    // limit is used.
+    if ((ctx->gen_loaded == 0) || (ctx->gen_reserving != 0) ||
+        (ctx->generation + HEAL_GENERATION_BATCH / 2 <= ctx->gen_reserved))
+    {
+        return 0;
+    }
+
+    ctx->gen_reserving = ctx->generation + HEAL_GENERATION_BATCH;
+
+    return ctx->gen_reserving;
+}
+
+/* Gets the generation reported to clients. Generations not stored yet
+ * could be reused after a crash, so they are never returned. Returning the
+ * stored limit instead would report the same generation for different
+ * contents, so nothing is reported until the reservation is stored. */
+int32_t __heal_generation_get(heal_inode_ctx_t * ctx, uint64_t * value)
+{
+    if (ctx->generation > ctx->gen_reserved)
+    {
+        return EAGAIN;
+    }
+
+    *value = ctx->generation;
+
+    return 0;
+}
+
+void heal_generation_store(xlator_t * xl, inode_t * inode, uint64_t value);
+
+int32_t heal_generation_store_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    heal_inode_ctx_t * ctx;
+    inode_t * inode;
+    uint64_t value;
+
+    inode = cookie;
+    value = 0;
+
+    LOCK(&inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, inode) == 0)
+    {
+        if (result >= 0)
+        {
+            ctx->gen_reserved = ctx->gen_reserving;
+        }
+        ctx->gen_reserving = 0;
+        // The counter could have advanced while the batch was being stored.
+        if (result >= 0)
+        {
+            value = __heal_generation_reserve(ctx);
+        }
+    }
+
+    UNLOCK(&inode->lock);
+
+    if ((result < 0) && (code != ENOENT) && (code != ESTALE))
+    {
+        gf_log(xl->name, GF_LOG_WARNING, "Unable to store the content generation of %s (error=%d)", uuid_utoa(inode->gfid), code);
+    }
+
+    STACK_DESTROY(frame->root);
+
+    if (value != 0)
+    {
+        heal_generation_store(xl, inode, value);
+    }
+
+    inode_unref(inode);
+
+    return 0;
+}
+
+/* Stores the limit of a new batch of content generations in background. */
+void heal_generation_store(xlator_t * xl, inode_t * inode, uint64_t value)
+{
+    heal_inode_ctx_t * ctx;
+    call_frame_t * frame;
+    dict_t * dict;
+    loc_t loc;
+
+    frame = NULL;
+    dict = dict_new();
+    if ((dict != NULL) && (heal_dict_set_uint64_cow(&dict, HEAL_KEY_GENERATION, value) == 0))
+    {
+        frame = create_frame(xl, xl->ctx->pool);
+    }
+    if (frame == NULL)
+    {
+        if (dict != NULL)
+        {
+            dict_unref(dict);
+        }
+
+        LOCK(&inode->lock);
+
+        if (__heal_inode_ctx_get(&ctx, xl, inode) == 0)
+        {
+            ctx->gen_reserving = 0;
+        }
+
+        UNLOCK(&inode->lock);
+
+        return;
+    }
+
+    memset(&loc, 0, sizeof(loc));
+    loc.inode = inode;
+    uuid_copy(loc.gfid, inode->gfid);
+
+    STACK_WIND_COOKIE(frame, heal_generation_store_cbk, inode_ref(inode), FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->setxattr, &loc, dict, 0, NULL);
+
+    dict_unref(dict);
+}
+
+/* Counts a modification of the contents of 'inode'. */
+void heal_generation_bump(xlator_t * xl, inode_t * inode)
+{
+    heal_private_t * priv;
+    heal_inode_ctx_t * ctx;
+    uint64_t value;
+
+    priv = xl->private;
+    if (!priv->generation)
+    {
+        return;
+    }
+
+    value = 0;
+
+    LOCK(&inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, inode) == 0)
+    {
+        ctx->generation++;
+        value = __heal_generation_reserve(ctx);
+    }
+
+    UNLOCK(&inode->lock);
+
+    if (value != 0)
+    {
+        heal_generation_store(xl, inode, value);
+    }
+}
+
+/* Records a completed modification of the data of 'inode'. */
+void heal_data_modified(xlator_t * xl, inode_t * inode)
+{
+    heal_inode_ctx_t * ctx;
+
+    LOCK(&inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, inode) == 0)
+    {
+        ctx->data_version++;
+    }
+
+    UNLOCK(&inode->lock);
+
+    heal_generation_bump(xl, inode);
+}
+
+/* Returns the number of modifications of the data of 'inode' completed
+ * until now. */
+uint64_t heal_data_version(xlator_t * xl, inode_t * inode)
+{
+    heal_inode_ctx_t * ctx;
+    uint64_t version;
+
+    version = 0;
+
+    LOCK(&inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, inode) == 0)
+    {
+        version = ctx->data_version;
+    }
+
+    UNLOCK(&inode->lock);
+
+    return version;
+}
+
+/* Loads the stored generation limit of 'inode'. Generations of the previous
+ * batch could have been used before a restart, so the counter continues
+ * from the limit, keeping any modification already counted. */
+uint64_t __heal_generation_load(heal_inode_ctx_t * ctx, dict_t * xdata)
+{
+    uint64_t value;
+
+    if (ctx->gen_loaded != 0)
+    {
+        return 0;
+    }
+
+    if ((xdata == NULL) || (heal_dict_get_uint64(xdata, HEAL_KEY_GENERATION, &value) != 0))
+    {
+        value = 0;
+    }
+    ctx->generation += value;
+    ctx->gen_reserved = value;
+    ctx->gen_loaded = 1;
+
+    return __heal_generation_reserve(ctx);
+}
+
+/* Removes from the lookup reply an xattr that must not reach the client. */
+void heal_lookup_clean(dict_t ** xdata, char * key)
+{
+    if ((*xdata != NULL) && (dict_get(*xdata, key) != NULL))
+    {
+        heal_dict_del_cow(xdata, key);
+    }
+}
+
+int32_t heal_lookup_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, inode_t * inode, struct iatt * attr, dict_t * xdata, struct iatt * attr_ppost)
+{
+    heal_inode_ctx_t * inode_ctx;
+    uint64_t version, generation, reserve;
+    uintptr_t request;
+    int32_t error, gen_error;
+
+    request = (uintptr_t)cookie;
+
+    if (xdata != NULL)
+    {
+        dict_ref(xdata);
+    }
+
+    if (result >= 0)
+    {
+        if ((request & HEAL_LOOKUP_DIRTY_GEN) != 0)
+        {
+            heal_dirty_gen_load(xl, xdata);
+        }
+
+        reserve = 0;
+        gen_error = ENODATA;
+
+        LOCK(&inode->lock);
+
+        error = __heal_inode_ctx_get(&inode_ctx, xl, inode);
+        if (error == 0)
+        {
+            version = inode_ctx->version;
+            if ((request & HEAL_LOOKUP_DIRTY) != 0)
+            {
+                __heal_dirty_load(xl, inode_ctx, xdata);
+            }
+            if ((request & HEAL_LOOKUP_GEN_LOAD) != 0)
+            {
+                reserve = __heal_generation_load(inode_ctx, xdata);
+            }
+            gen_error = __heal_generation_get(inode_ctx, &generation);
+        }
+
+        UNLOCK(&inode->lock);
+
+        if (reserve != 0)
+        {
+            heal_generation_store(xl, inode, reserve);
+        }
+        // The value returned by posix is the stored limit, never a
+        // generation that can be reported.
+        if ((error == 0) && ((request & HEAL_LOOKUP_GEN) != 0) && (gen_error == 0))
+        {
+            xdata = heal_xdata_ref(xdata);
+            if (xdata != NULL)
+            {
+                heal_dict_set_uint64_cow(&xdata, HEAL_KEY_GENERATION, generation);
+            }
+        }
+        else if ((request & (HEAL_LOOKUP_GEN | HEAL_LOOKUP_GEN_LOAD)) != 0)
+        {
+            heal_lookup_clean(&xdata, HEAL_KEY_GENERATION);
+        }
+
+        if ((request & HEAL_LOOKUP_DIRTY_OWN) != 0)
+        {
+            heal_lookup_clean(&xdata, HEAL_KEY_DIRTY);
+        }
+        if ((request & HEAL_LOOKUP_DIRTY_GEN_OWN) != 0)
+        {
+            heal_lookup_clean(&xdata, HEAL_KEY_DIRTY_GEN);
+        }
+
+        if ((error == 0) && ((request & HEAL_LOOKUP_VERSION) != 0))
+        {
+            xdata = heal_xdata_ref(xdata);
+            if (xdata != NULL)
+            {
+                heal_dict_set_uint64_cow(&xdata, HEAL_KEY_VERSION, version);
+            }
+        }
+        if ((error == 0) && ((request & HEAL_LOOKUP_STATE) != 0))
+        {
+            xdata = heal_xdata_ref(xdata);
+            if (xdata != NULL)
+            {
+                heal_state_set(xl, inode, &xdata);
+            }
+        }
+    }
+
+    STACK_UNWIND_STRICT(lookup, frame, result, code, inode, attr, xdata, attr_ppost);
+
+    if (xdata != NULL)
+    {
+        dict_unref(xdata);
+    }
+
+    return 0;
+}
+
+int32_t heal_lookup(call_frame_t * frame, xlator_t * xl, loc_t * loc, dict_t * xdata)
+{
+    heal_private_t * priv;
+    heal_inode_ctx_t * ctx;
+    uintptr_t request;
+    int32_t error;
+
+    priv = xl->private;
+
+    error = heal_inode_ctx_new(&ctx, xl, loc->inode, 0, 0);
+    if (error == 0)
+    {
+        request = 0;
+        if ((xdata != NULL) && (dict_get(xdata, HEAL_KEY_VERSION) != NULL))
+        {
+            request |= HEAL_LOOKUP_VERSION;
+        }
+        if ((xdata != NULL) && (dict_get(xdata, HEAL_KEY_STATE) != NULL))
+        {
+            request |= HEAL_LOOKUP_STATE;
+        }
+        // Xattrs not requested by the client are removed from the reply.
+        if (priv->dirty_gen != 0)
+        {
+            request |= HEAL_LOOKUP_DIRTY;
+            if ((xdata == NULL) || (dict_get(xdata, HEAL_KEY_DIRTY) == NULL))
+            {
+                request |= HEAL_LOOKUP_DIRTY_OWN;
+            }
+        }
+        if (!priv->dirty_loaded && heal_loc_is_root(loc))
+        {
+            request |= HEAL_LOOKUP_DIRTY_GEN;
+            if ((xdata == NULL) || (dict_get(xdata, HEAL_KEY_DIRTY_GEN) == NULL))
+            {
+                request |= HEAL_LOOKUP_DIRTY_GEN_OWN;
+            }
+        }
+        if (priv->generation)
+        {
+            if (ctx->gen_loaded == 0)
+            {
+                request |= HEAL_LOOKUP_GEN_LOAD;
+            }
+            if ((xdata != NULL) && (dict_get(xdata, HEAL_KEY_GENERATION) != NULL))
+            {
+                request |= HEAL_LOOKUP_GEN;
+            }
+        }
+
+        if (request == 0)
+        {
+            STACK_WIND(frame, default_lookup_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->lookup, loc, xdata);
+
+            return 0;
+        }
+
+        // Xattrs requested in lookup are returned by posix in the answer.
+        xdata = heal_xdata_ref(xdata);
+        if (xdata != NULL)
+        {
+            if ((request & HEAL_LOOKUP_DIRTY) != 0)
+            {
+                heal_dict_set_uint64_cow(&xdata, HEAL_KEY_DIRTY, 0);
+            }
+            if ((request & HEAL_LOOKUP_DIRTY_GEN) != 0)
+            {
+                heal_dict_set_uint64_cow(&xdata, HEAL_KEY_DIRTY_GEN, 0);
+            }
+            if ((request & HEAL_LOOKUP_GEN_LOAD) != 0)
+            {
+                heal_dict_set_uint64_cow(&xdata, HEAL_KEY_GENERATION, 0);
+            }
+
+            STACK_WIND_COOKIE(frame, heal_lookup_cbk, (void *)request, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->lookup, loc, xdata);
+
+            dict_unref(xdata);
+
+            return 0;
+        }
+
+        error = ENOMEM;
+    }
+
+    STACK_UNWIND_STRICT(lookup, frame, -1, error, NULL, NULL, NULL, NULL);
+
+    return 0;
+}
+
+int32_t heal_open_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, fd_t * fd, dict_t * xdata)
+{
+    heal_inode_ctx_t * inode_ctx;
+    heal_fd_ctx_t * fd_ctx;
+    uint64_t size, offset;
+    uint32_t lease;
+    int32_t error, started;
+
+    // The cookie contains the lease and whether the heal has been started
+    // by this open.
+    lease = (uintptr_t)cookie >> 1;
+    started = (uintptr_t)cookie & 1;
+
+    if (xdata != NULL)
+    {
+        dict_ref(xdata);
+    }
+
+    if ((result >= 0) && (lease != 0))
+    {
+        error = heal_fd_ctx_new(&fd_ctx, xl, fd);
+        if (error == 0)
+        {
+            LOCK(&fd->inode->lock);
+
+            error = __heal_inode_ctx_get(&inode_ctx, xl, fd->inode);
+            if ((error == 0) && ((inode_ctx->healing == 0) || (inode_ctx->lease != lease)))
+            {
+                // The heal has finished or has been taken over again while
+                // the file was being opened.
+                error = ESTALE;
+            }
+            if (error == 0)
+            {
+                size = inode_ctx->size;
+                offset = inode_ctx->offset;
+            }
+
+            UNLOCK(&fd->inode->lock);
+        }
+        if (error == 0)
+        {
+            fd_ctx->healing = 1;
+            fd_ctx->lease = heal_inode_register(xl, fd->inode, fd->inode->gfid, frame);
+
+            xdata = heal_xdata_ref(xdata);
+            if (xdata != NULL)
+            {
+                heal_dict_set_uint64_cow(&xdata, HEAL_KEY_SIZE, size);
+                heal_dict_set_uint64_cow(&xdata, HEAL_KEY_OFFSET, offset);
+            }
+        }
+        else
+        {
+            code = error;
+            result = -1;
+        }
+    }
+    if ((result < 0) && started && (fd != NULL))
+    {
+        heal_inode_clear_healing(xl, fd->inode, lease);
+    }
+
+    STACK_UNWIND_STRICT(open, frame, result, code, fd, xdata);
+
+    if (xdata != NULL)
+    {
+        dict_unref(xdata);
+    }
+
+    return 0;
+}
+
+int32_t heal_open(call_frame_t * frame, xlator_t * xl, loc_t * loc, int32_t flags, fd_t * fd, dict_t * xdata)
+{
+    uint64_t size, offset;
+    uint32_t value, lease;
+    int32_t error, started;
+
+    if ((xdata != NULL) && (heal_dict_get_uint32(xdata, HEAL_KEY_FLAGS, &value) == 0) && ((value & (HEAL_FLAG_TAKEOVER | HEAL_FLAG_DATA)) != 0))
+    {
+        started = 0;
+        if ((value & HEAL_FLAG_TAKEOVER) != 0)
+        {
+            error = heal_inode_takeover(xl, loc->inode, &lease);
+        }
+        else if (heal_dict_get_uint64(xdata, HEAL_KEY_SIZE, &size) != 0)
+        {
+            error = EINVAL;
+        }
+        else
+        {
+            if (heal_dict_get_uint64(xdata, HEAL_KEY_OFFSET, &offset) != 0)
+            {
+                offset = 0;
+            }
+            error = heal_inode_start(xl, loc->inode, size, offset, (value & HEAL_FLAG_JOURNAL) != 0, &lease);
+            started = 1;
+        }
+        if (error == 0)
+        {
+            STACK_WIND_COOKIE(frame, heal_open_cbk, (void *)(((uintptr_t)lease << 1) | started), FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->open, loc, flags, fd, xdata);
+
+            return 0;
+        }
+
+        STACK_UNWIND_STRICT(open, frame, -1, error, NULL, NULL);
+
+        return 0;
+    }
+
+    STACK_WIND(frame, default_open_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->open, loc, flags, fd, xdata);
+
+    return 0;
+}
+
+int32_t heal_readdirp_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, gf_dirent_t * entries, dict_t * xdata)
+{
+    heal_inode_ctx_t * ctx;
+    gf_dirent_t * entry;
+    int32_t state;
+
+    state = (cookie != NULL);
+
+    if (result > 0)
+    {
+        list_for_each_entry(entry, &entries->list, list)
+        {
+            if (entry->inode == NULL)
+            {
+                continue;
+            }
+            // Entries returned by readdirp won't be looked up before being
+            // used, so their contexts need to be created here.
+            if (heal_inode_ctx_new(&ctx, xl, entry->inode, 0, 0) != 0)
+            {
+                continue;
+            }
+            if (state && (entry->d_stat.ia_type == IA_IFREG))
+            {
+                if (entry->dict == NULL)
+                {
+                    entry->dict = dict_new();
+                    if (entry->dict == NULL)
+                    {
+                        continue;
+                    }
+                }
+                heal_state_set(xl, entry->inode, &entry->dict);
+            }
+        }
+    }
+
+    STACK_UNWIND_STRICT(readdirp, frame, result, code, entries, xdata);
+
+    return 0;
+}
+
+int32_t heal_readdirp(call_frame_t * frame, xlator_t * xl, fd_t * fd, size_t size, off_t offset, dict_t * xdata)
+{
+    void * state;
+
+    state = NULL;
+    if ((xdata != NULL) && (dict_get(xdata, HEAL_KEY_STATE) != NULL))
+    {
+        state = xl;
+    }
+
+    STACK_WIND_COOKIE(frame, heal_readdirp_cbk, state, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->readdirp, fd, size, offset, xdata);
+
+    return 0;
+}
+
+int32_t heal_rchecksum(call_frame_t * frame, xlator_t * xl, fd_t * fd, off_t offset, int32_t len, dict_t * xdata)
+{
+    dict_t * reply;
+    int32_t error;
+
+    error = heal_inode_ctx_check_range(xl, fd->inode, offset, offset + len, &reply);
+    if (error == 0)
+    {
+        STACK_WIND(frame, default_rchecksum_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->rchecksum, fd, offset, len, xdata);
+
+        return 0;
+    }
+
+    STACK_UNWIND_STRICT(rchecksum, frame, -1, error, 0, NULL, reply);
+
+    if (reply != NULL)
+    {
+        dict_unref(reply);
+    }
+
+    return error;
+}
+
+int32_t heal_readv(call_frame_t * frame, xlator_t * xl, fd_t * fd, size_t size, off_t offset, uint32_t flags, dict_t * xdata);
+
+/* Returns the readahead stream of the fd, creating it if needed. */
+int32_t heal_fd_stream_get(xlator_t * xl, fd_t * fd, heal_stream_t ** stream)
+{
+    heal_fd_ctx_t * fd_ctx;
+    int32_t error;
+
+    error = heal_fd_ctx_new(&fd_ctx, xl, fd);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    LOCK(&fd->lock);
+
+    if (fd_ctx->stream == NULL)
+    {
+        fd_ctx->stream = heal_stream_new(fd);
+    }
+    *stream = fd_ctx->stream;
+
+    UNLOCK(&fd->lock);
+
+    return (*stream == NULL) ? ENOMEM : 0;
+}
+
+void heal_readv_stream_resume(struct list_head * waiters)
+{
+    call_stub_t * stub, * tmp;
+
+    list_for_each_entry_safe(stub, tmp, waiters, list)
+    {
+        list_del_init(&stub->list);
+        call_resume(stub);
+    }
+}
+
+int32_t heal_readv_stream_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iovec * vector, int32_t count, struct iatt * attr, struct iobref * iobref, dict_t * xdata)
+{
+    heal_private_t * priv;
+    heal_stream_block_t * block;
+    struct list_head waiters;
+    fd_t * fd;
+
+    priv = xl->private;
+    block = cookie;
+    // The block can be released as soon as it's completed.
+    fd = block->stream->fd;
+
+    if (result > 0)
+    {
+        __sync_fetch_and_add(&priv->stream_readahead, result);
+    }
+
+    INIT_LIST_HEAD(&waiters);
+    heal_stream_complete(block, result, (result < 0) ? code : 0, vector, count, iobref, attr, &waiters);
+
+    STACK_DESTROY(frame->root);
+
+    heal_readv_stream_resume(&waiters);
+
+    fd_unref(fd);
+
+    return 0;
+}
+
+/* Sends to the brick the reads of the blocks requested by the stream. Each
+ * one uses its own frame, so they are independent of the request that
+ * started them: that request can be resumed by the completion of another
+ * block and released while these reads are being sent. */
+void heal_readv_stream_issue(xlator_t * xl, heal_stream_t * stream, uint32_t flags, struct list_head * issue)
+{
+    heal_stream_block_t * block, * tmp;
+    call_frame_t * ahead;
+    struct list_head waiters;
+
+    list_for_each_entry_safe(block, tmp, issue, issue)
+    {
+        list_del_init(&block->issue);
+
+        ahead = create_frame(xl, xl->ctx->pool);
+        if (ahead == NULL)
+        {
+            INIT_LIST_HEAD(&waiters);
+            heal_stream_complete(block, -1, ENOMEM, NULL, 0, NULL, NULL, &waiters);
+            heal_readv_stream_resume(&waiters);
+
+            continue;
+        }
+
+        fd_ref(stream->fd);
+        STACK_WIND_COOKIE(ahead, heal_readv_stream_cbk, block, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->readv, stream->fd, block->size, block->offset, flags, NULL);
+    }
+}
+
+/* Builds the reply xdata of a heal source read with the MD5 checksum of
+ * each element of the vector. */
+int32_t heal_readv_stream_checksums(struct iovec * vector, int32_t count, dict_t ** xdata)
+{
+    uint8_t * data;
+    int32_t i;
+
+    data = GF_MALLOC(count * HEAL_CHECKSUM_SIZE, gf_heal_mt_uint8_t);
+    if (data == NULL)
+    {
+        return ENOMEM;
+    }
+    for (i = 0; i < count; i++)
+    {
+        gf_rsync_strong_checksum(vector[i].iov_base, vector[i].iov_len, data + i * HEAL_CHECKSUM_SIZE);
+    }
+
+    *xdata = dict_new();
+    if ((*xdata == NULL) || (dict_set_bin(*xdata, HEAL_KEY_CHECKSUM, data, count * HEAL_CHECKSUM_SIZE) != 0))
+    {
+        if (*xdata != NULL)
+        {
+            dict_unref(*xdata);
+            *xdata = NULL;
+        }
+        GF_FREE(data);
+
+        return ENOMEM;
+    }
+
+    return 0;
+}
+
+/* Serves a sequential read of a heal source from the readahead stream of
+ * the fd. If the data is not available yet, the request is resumed once
+ * the blocks it needs have been read. */
+int32_t heal_readv_stream(call_frame_t * frame, xlator_t * xl, fd_t * fd, size_t size, off_t offset, uint32_t flags, dict_t * xdata, uint32_t mode)
+{
+    heal_private_t * priv;
+    heal_stream_t * stream;
+    heal_stream_reply_t data;
+    struct list_head issue;
+    call_stub_t * stub;
+    dict_t * reply;
+    int32_t error;
+
+    priv = xl->private;
+    reply = NULL;
+
+    error = heal_fd_stream_get(xl, fd, &stream);
+    if (error != 0)
+    {
+        goto failed;
+    }
+
+    // The stub must be queued atomically with the check of the blocks, so
+    // it's created before knowing if it will be needed.
+    stub = fop_readv_stub(frame, heal_readv, fd, size, offset, flags, xdata);
+    if (stub == NULL)
+    {
+        error = ENOMEM;
+
+        goto failed;
+    }
+
+    INIT_LIST_HEAD(&issue);
+    error = heal_stream_read(stream, heal_data_version(xl, fd->inode), offset, size, priv->readahead_window, priv->readahead_block, stub, &issue, &data);
+
+    // The stub can be resumed as soon as it's queued, so neither it nor
+    // the frame can be used after this point if it has been queued.
+    heal_readv_stream_issue(xl, stream, flags, &issue);
+
+    if (error == EINPROGRESS)
+    {
+        __sync_fetch_and_add(&priv->stream_waits, 1);
+
+        return 0;
+    }
+    call_stub_destroy(stub);
+    if (error != 0)
+    {
+        goto failed;
+    }
+
+    __sync_fetch_and_add(&priv->stream_reads, 1);
+    __sync_fetch_and_add(&priv->stream_bytes, iov_length(data.vector, data.count));
+
+    if (((mode & HEAL_SOURCE_CHECKSUM) != 0) && (data.count > 0))
+    {
+        error = heal_readv_stream_checksums(data.vector, data.count, &reply);
+        if (error != 0)
+        {
+            heal_stream_reply_release(&data);
+
+            goto failed;
+        }
+    }
+
+    STACK_UNWIND_STRICT(readv, frame, iov_length(data.vector, data.count), 0, data.vector, data.count, &data.attr, data.iobref, reply);
+
+    heal_stream_reply_release(&data);
+    if (reply != NULL)
+    {
+        dict_unref(reply);
+    }
+
+    return 0;
+
+failed:
+    STACK_UNWIND_STRICT(readv, frame, -1, error, NULL, 0, NULL, NULL, NULL);
+
+    return 0;
+}
+
+int32_t heal_readv(call_frame_t * frame, xlator_t * xl, fd_t * fd, size_t size, off_t offset, uint32_t flags, dict_t * xdata)
+{
+    heal_private_t * priv;
+    dict_t * reply;
+    uint32_t mode;
+    int32_t error;
+
+    priv = xl->private;
+
+    error = heal_inode_ctx_check_range(xl, fd->inode, offset, offset + size, &reply);
+    if (error == 0)
+    {
+        // Sequential reads of heal sources are served from a readahead
+        // stream. Reads bigger than the window gain nothing from it.
+        if ((xdata != NULL) && (heal_dict_get_uint32(xdata, HEAL_KEY_SOURCE, &mode) == 0) &&
+            (priv->readahead_window != 0) && (size <= priv->readahead_window))
+        {
+            return heal_readv_stream(frame, xl, fd, size, offset, flags, xdata, mode);
+        }
+
+        heal_heat_account(&priv->heat, fd->inode->gfid, HEAL_HEAT_READ, size);
+
+        STACK_WIND(frame, default_readv_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->readv, fd, size, offset, flags, xdata);
+
+        return 0;
+    }
+
+    STACK_UNWIND_STRICT(readv, frame, -1, error, NULL, 0, NULL, NULL, reply);
+
+    if (reply != NULL)
+    {
+        dict_unref(reply);
+    }
+
+    return error;
+}
+
+int32_t heal_removexattr_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    if (cookie != NULL)
+    {
+        heal_meta_client_end(xl, cookie);
+    }
+
+    STACK_UNWIND_STRICT(removexattr, frame, result, code, xdata);
+
+    return 0;
+}
+
+int32_t heal_removexattr(call_frame_t * frame, xlator_t * xl, loc_t * loc, const char * name, dict_t * xdata)
+{
+    int32_t error, tracked;
+
+    error = heal_meta_client_begin(xl, loc->inode, &tracked);
+    if (error == 0)
+    {
+        STACK_WIND_COOKIE(frame, heal_removexattr_cbk, tracked ? inode_ref(loc->inode) : NULL, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->removexattr, loc, name, xdata);
+
+        return 0;
+    }
+    if (error == EINPROGRESS)
+    {
+        error = heal_meta_client_queue(xl, loc->inode, fop_removexattr_stub(frame, heal_removexattr, loc, name, xdata));
+        if (error == 0)
+        {
+            return 0;
+        }
+    }
+
+    STACK_UNWIND_STRICT(removexattr, frame, -1, error, NULL);
+
+    return 0;
+}
+
+int32_t heal_fremovexattr_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    if (cookie != NULL)
+    {
+        heal_meta_client_end(xl, cookie);
+    }
+
+    STACK_UNWIND_STRICT(fremovexattr, frame, result, code, xdata);
+
+    return 0;
+}
+
+int32_t heal_fremovexattr(call_frame_t * frame, xlator_t * xl, fd_t * fd, const char * name, dict_t * xdata)
+{
+    int32_t error, tracked;
+
+    error = heal_meta_client_begin(xl, fd->inode, &tracked);
+    if (error == 0)
+    {
+        STACK_WIND_COOKIE(frame, heal_fremovexattr_cbk, tracked ? inode_ref(fd->inode) : NULL, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fremovexattr, fd, name, xdata);
+
+        return 0;
+    }
+    if (error == EINPROGRESS)
+    {
+        error = heal_meta_client_queue(xl, fd->inode, fop_fremovexattr_stub(frame, heal_fremovexattr, fd, name, xdata));
+        if (error == 0)
+        {
+            return 0;
+        }
+    }
+
+    STACK_UNWIND_STRICT(fremovexattr, frame, -1, error, NULL);
+
+    return 0;
+}
+
+int32_t heal_setattr_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    if (cookie != NULL)
+    {
+        heal_meta_client_end(xl, cookie);
+    }
+
+    STACK_UNWIND_STRICT(setattr, frame, result, code, attr_pre, attr_post, xdata);
+
+    return 0;
+}
+
+int32_t heal_setattr(call_frame_t * frame, xlator_t * xl, loc_t * loc, struct iatt * attr, int32_t valid, dict_t * xdata)
+{
+    int32_t error, tracked;
+
+    error = heal_meta_client_begin(xl, loc->inode, &tracked);
+    if (error == 0)
+    {
+        STACK_WIND_COOKIE(frame, heal_setattr_cbk, tracked ? inode_ref(loc->inode) : NULL, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->setattr, loc, attr, valid, xdata);
+
+        return 0;
+    }
+    if (error == EINPROGRESS)
+    {
+        error = heal_meta_client_queue(xl, loc->inode, fop_setattr_stub(frame, heal_setattr, loc, attr, valid, xdata));
+        if (error == 0)
+        {
+            return 0;
+        }
+    }
+
+    STACK_UNWIND_STRICT(setattr, frame, -1, error, NULL, NULL, NULL);
+
+    return 0;
+}
+
+int32_t heal_fsetattr_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    if (cookie != NULL)
+    {
+        heal_meta_client_end(xl, cookie);
+    }
+
+    STACK_UNWIND_STRICT(fsetattr, frame, result, code, attr_pre, attr_post, xdata);
+
+    return 0;
+}
+
+int32_t heal_fsetattr(call_frame_t * frame, xlator_t * xl, fd_t * fd, struct iatt * attr, int32_t valid, dict_t * xdata)
+{
+    int32_t error, tracked;
+
+    error = heal_meta_client_begin(xl, fd->inode, &tracked);
+    if (error == 0)
+    {
+        STACK_WIND_COOKIE(frame, heal_fsetattr_cbk, tracked ? inode_ref(fd->inode) : NULL, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fsetattr, fd, attr, valid, xdata);
+
+        return 0;
+    }
+    if (error == EINPROGRESS)
+    {
+        error = heal_meta_client_queue(xl, fd->inode, fop_fsetattr_stub(frame, heal_fsetattr, fd, attr, valid, xdata));
+        if (error == 0)
+        {
+            return 0;
+        }
+    }
+
+    STACK_UNWIND_STRICT(fsetattr, frame, -1, error, NULL, NULL, NULL);
+
+    return 0;
+}
+
+int32_t heal_setxattr_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    if (cookie != NULL)
+    {
+        heal_meta_client_end(xl, cookie);
+    }
+
+    STACK_UNWIND_STRICT(setxattr, frame, result, code, xdata);
+
+    return 0;
+}
+
+int32_t heal_setxattr(call_frame_t * frame, xlator_t * xl, loc_t * loc, dict_t * dict, int32_t flags, dict_t * xdata)
+{
+    uint64_t version;
+    int32_t error, tracked;
+
+    if (dict_get(dict, HEAL_KEY_DIRTY_GEN) != NULL)
+    {
+        error = heal_dirty_gen_set(frame, xl, loc, dict, flags, xdata);
+        if (error == 0)
+        {
+            return 0;
+        }
+
+        goto failed;
+    }
+
+    error = heal_meta_request(xdata, &version);
+    if (error != 0)
+    {
+        if (error > 0)
+        {
+            error = heal_meta_heal(frame, xl, loc->inode, loc, NULL, dict, flags, xdata, version);
+            if (error == 0)
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            error = EINVAL;
+        }
+
+        goto failed;
+    }
+
+    error = heal_meta_client_begin(xl, loc->inode, &tracked);
+    if (error == 0)
+    {
+        STACK_WIND_COOKIE(frame, heal_setxattr_cbk, tracked ? inode_ref(loc->inode) : NULL, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->setxattr, loc, dict, flags, xdata);
+
+        return 0;
+    }
+    if (error == EINPROGRESS)
+    {
+        error = heal_meta_client_queue(xl, loc->inode, fop_setxattr_stub(frame, heal_setxattr, loc, dict, flags, xdata));
+        if (error == 0)
+        {
+            return 0;
+        }
+    }
+
+failed:
+    STACK_UNWIND_STRICT(setxattr, frame, -1, error, NULL);
+
+    return 0;
+}
+
+int32_t heal_fsetxattr_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    if (cookie != NULL)
+    {
+        heal_meta_client_end(xl, cookie);
+    }
+
+    STACK_UNWIND_STRICT(fsetxattr, frame, result, code, xdata);
+
+    return 0;
+}
+
+int32_t heal_fsetxattr(call_frame_t * frame, xlator_t * xl, fd_t * fd, dict_t * dict, int32_t flags, dict_t * xdata)
+{
+    uint64_t version;
+    int32_t error, tracked;
+
+    error = heal_meta_request(xdata, &version);
+    if (error != 0)
+    {
+        if (error > 0)
+        {
+            error = heal_meta_heal(frame, xl, fd->inode, NULL, fd, dict, flags, xdata, version);
+            if (error == 0)
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            error = EINVAL;
+        }
+
+        goto failed;
+    }
+
+    error = heal_meta_client_begin(xl, fd->inode, &tracked);
+    if (error == 0)
+    {
+        STACK_WIND_COOKIE(frame, heal_fsetxattr_cbk, tracked ? inode_ref(fd->inode) : NULL, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fsetxattr, fd, dict, flags, xdata);
+
+        return 0;
+    }
+    if (error == EINPROGRESS)
+    {
+        error = heal_meta_client_queue(xl, fd->inode, fop_fsetxattr_stub(frame, heal_fsetxattr, fd, dict, flags, xdata));
+        if (error == 0)
+        {
+            return 0;
+        }
+    }
+
+failed:
+    STACK_UNWIND_STRICT(fsetxattr, frame, -1, error, NULL);
+
+    return 0;
+}
+
+int32_t heal_stat(call_frame_t * frame, xlator_t * xl, loc_t * loc, dict_t * xdata)
+{
+    dict_t * reply;
+    int32_t error;
+
+    error = heal_inode_ctx_check(xl, loc->inode, &reply);
+    if (error == 0)
+    {
+        STACK_WIND(frame, default_stat_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->stat, loc, xdata);
+
+        return 0;
+    }
+
+    STACK_UNWIND_STRICT(stat, frame, -1, error, NULL, reply);
+
+    if (reply != NULL)
+    {
+        dict_unref(reply);
+    }
+
+    return 0;
+}
+
+int32_t heal_fstat(call_frame_t * frame, xlator_t * xl, fd_t * fd, dict_t * xdata)
+{
+    dict_t * reply;
+    int32_t error;
+
+    error = heal_inode_ctx_check(xl, fd->inode, &reply);
+    if (error == 0)
+    {
+        STACK_WIND(frame, default_fstat_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fstat, fd, xdata);
+
+        return 0;
+    }
+
+    STACK_UNWIND_STRICT(fstat, frame, -1, error, NULL, reply);
+
+    if (reply != NULL)
+    {
+        dict_unref(reply);
+    }
+
+    return 0;
+}
+
+int32_t heal_truncate_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    inode_t * inode;
+    int32_t error;
+
+    inode = cookie;
+    error = heal_truncate_end(xl, inode, result, attr_post);
+    if ((error != 0) && (result >= 0))
+    {
+        code = error;
+        result = -1;
+    }
+    if (result >= 0)
+    {
+        heal_data_modified(xl, inode);
+    }
+
+    inode_unref(inode);
+
+    STACK_UNWIND_STRICT(truncate, frame, result, code, attr_pre, attr_post, xdata);
+
+    return 0;
+}
+
+int32_t heal_truncate(call_frame_t * frame, xlator_t * xl, loc_t * loc, off_t offset, dict_t * xdata)
+{
+    void * data;
+    uint32_t length;
+    int32_t error;
+
+    data = NULL;
+    error = heal_dirty_check(xl, loc->inode, offset, UINT64_MAX, &data, &length);
+    if ((error == EINPROGRESS) || (error == EAGAIN))
+    {
+        error = heal_dirty_defer(frame, xl, loc->inode, loc, NULL, error, data, length, fop_truncate_stub(frame, heal_truncate, loc, offset, xdata), heal_dirty_fail_truncate);
+        if (error == 0)
+        {
+            return 0;
+        }
+    }
+    if (error == 0)
+    {
+        error = heal_truncate_begin(xl, loc->inode);
+    }
+    if (error == 0)
+    {
+        STACK_WIND_COOKIE(frame, heal_truncate_cbk, inode_ref(loc->inode), FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->truncate, loc, offset, xdata);
+
+        return 0;
+    }
+    if (error == EINPROGRESS)
+    {
+        error = heal_data_queue(xl, loc->inode, fop_truncate_stub(frame, heal_truncate, loc, offset, xdata), 0);
+        if (error == 0)
+        {
+            return 0;
+        }
+    }
+
+    STACK_UNWIND_STRICT(truncate, frame, -1, error, NULL, NULL, NULL);
+
+    return 0;
+}
+
+int32_t heal_ftruncate_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    inode_t * inode;
+    int32_t error;
+
+    inode = cookie;
+    error = heal_truncate_end(xl, inode, result, attr_post);
+    if ((error != 0) && (result >= 0))
+    {
+        code = error;
+        result = -1;
+    }
+    if (result >= 0)
+    {
+        heal_data_modified(xl, inode);
+    }
+
+    inode_unref(inode);
+
+    STACK_UNWIND_STRICT(ftruncate, frame, result, code, attr_pre, attr_post, xdata);
+
+    return 0;
+}
+
+int32_t heal_ftruncate(call_frame_t * frame, xlator_t * xl, fd_t * fd, off_t offset, dict_t * xdata)
+{
+    void * data;
+    uint32_t length;
+    int32_t error;
+
+    data = NULL;
+    error = heal_dirty_check(xl, fd->inode, offset, UINT64_MAX, &data, &length);
+    if ((error == EINPROGRESS) || (error == EAGAIN))
+    {
+        error = heal_dirty_defer(frame, xl, fd->inode, NULL, fd, error, data, length, fop_ftruncate_stub(frame, heal_ftruncate, fd, offset, xdata), heal_dirty_fail_ftruncate);
+        if (error == 0)
+        {
+            return 0;
+        }
+    }
+    if (error == 0)
+    {
+        error = heal_truncate_begin(xl, fd->inode);
+    }
+    if (error == 0)
+    {
+        STACK_WIND_COOKIE(frame, heal_ftruncate_cbk, inode_ref(fd->inode), FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->ftruncate, fd, offset, xdata);
+
+        return 0;
+    }
+    if (error == EINPROGRESS)
+    {
+        error = heal_data_queue(xl, fd->inode, fop_ftruncate_stub(frame, heal_ftruncate, fd, offset, xdata), 0);
+        if (error == 0)
+        {
+            return 0;
+        }
+    }
+
+    STACK_UNWIND_STRICT(ftruncate, frame, -1, error, NULL, NULL, NULL);
+
+    return 0;
+}
+
+int32_t heal_unlink_stat_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr, dict_t * xdata)
+{
+    heal_unlink_local_t * local;
+
+    local = cookie;
+
+    // The gfid of the inode can only be resolved while it has some link.
+    if (((result < 0) && ((code == ENOENT) || (code == ESTALE))) || ((result >= 0) && (attr->ia_nlink == 0)))
+    {
+        heal_inode_abort_healing(xl, local->inode, "the file has been removed");
+    }
+    else
+    {
+        heal_generation_bump(xl, local->inode);
+    }
+
+    inode_unref(local->inode);
+
+    STACK_UNWIND_STRICT(unlink, frame, 0, 0, &local->attr_ppre, &local->attr_ppost, local->xdata);
+
+    if (local->xdata != NULL)
+    {
+        dict_unref(local->xdata);
+    }
+    GF_FREE(local);
+
+    return 0;
+}
+
+int32_t heal_unlink_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_ppre, struct iatt * attr_ppost, dict_t * xdata)
+{
+    heal_unlink_local_t * local;
+    heal_inode_ctx_t * inode_ctx;
+    int32_t error, healing;
+    loc_t loc;
+
+    local = cookie;
+    if (result >= 0)
+    {
+        healing = 0;
+
+        LOCK(&local->inode->lock);
+
+        error = __heal_inode_ctx_get(&inode_ctx, xl, local->inode);
+        if (error == 0)
+        {
+            healing = inode_ctx->healing;
+        }
+
+        UNLOCK(&local->inode->lock);
+
+        // The reply of unlink does not contain the attributes of the file,
+        // and checking the number of links before removing it would race
+        // with other link and unlink requests, so the inode is checked
+        // again once the link has been removed.
+        if ((error == 0) && (healing != 0))
+        {
+            local->attr_ppre = *attr_ppre;
+            local->attr_ppost = *attr_ppost;
+            local->xdata = (xdata != NULL) ? dict_ref(xdata) : NULL;
+
+            memset(&loc, 0, sizeof(loc));
+            loc.inode = local->inode;
+            uuid_copy(loc.gfid, local->inode->gfid);
+
+            STACK_WIND_COOKIE(frame, heal_unlink_stat_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->stat, &loc, NULL);
+
+            return 0;
+        }
+        if (error == 0)
+        {
+            heal_generation_bump(xl, local->inode);
+        }
+        else
+        {
+            code = error;
+            result = -1;
+        }
+    }
+
+    inode_unref(local->inode);
+    GF_FREE(local);
+
+    STACK_UNWIND_STRICT(unlink, frame, result, code, attr_ppre, attr_ppost, xdata);
+
+    return 0;
+}
+
+int32_t heal_unlink(call_frame_t * frame, xlator_t * xl, loc_t * loc, int xflags, dict_t * xdata)
+{
+    heal_unlink_local_t * local;
+
+    local = GF_MALLOC(sizeof(heal_unlink_local_t), gf_heal_mt_heal_unlink_local_t);
+    if (local == NULL)
+    {
+        STACK_UNWIND_STRICT(unlink, frame, -1, ENOMEM, NULL, NULL, NULL);
+
+        return 0;
+    }
+    local->inode = inode_ref(loc->inode);
+    local->xdata = NULL;
+
+    STACK_WIND_COOKIE(frame, heal_unlink_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->unlink, loc, xflags, xdata);
+
+    return 0;
+}
+
+int32_t heal_writev_unwind(call_frame_t * frame, heal_write_local_t * local, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    if (xdata != NULL)
+    {
+        dict_ref(xdata);
+    }
+    if (result >= 0)
+    {
+        if ((local->vector != NULL) && (result == iov_length(local->vector, local->count)))
+        {
+            // The data beyond the heal target has been discarded on purpose.
+            result = local->length;
+        }
+        xdata = heal_xdata_ref(xdata);
+        if (xdata != NULL)
+        {
+            heal_dict_set_uint64_cow(&xdata, HEAL_KEY_SIZE, local->size);
+        }
+    }
+
+    STACK_UNWIND_STRICT(writev, frame, result, code, attr_pre, attr_post, xdata);
+
+    if (xdata != NULL)
+    {
+        dict_unref(xdata);
+    }
+    inode_unref(local->inode);
+    if (local->iobref != NULL)
+    {
+        iobref_unref(local->iobref);
+    }
+    if (local->request != NULL)
+    {
+        dict_unref(local->request);
+    }
+    GF_FREE(local->vector);
+    GF_FREE(local);
+
+    return 0;
+}
+
+int32_t heal_writev_map_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    heal_private_t * priv;
+    heal_write_local_t * local;
+    dict_t * tmp;
+
+    priv = xl->private;
+    local = cookie;
+
+    if (result < 0)
+    {
+        gf_log(xl->name, GF_LOG_WARNING, "Unable to store the integrity map of %s (error=%d)", uuid_utoa(local->inode->gfid), code);
+
+        heal_map_destroy(local->map);
+    }
+    else
+    {
+        heal_scrub_queue(&priv->scrub, local->inode, local->map);
+    }
+
+    tmp = local->xdata;
+    heal_writev_unwind(frame, local, local->result, local->code, &local->attr_pre, &local->attr_post, tmp);
+    if (tmp != NULL)
+    {
+        dict_unref(tmp);
+    }
+
+    return 0;
+}
+
+/* Stores the integrity map of a completed heal before answering the last
+ * heal write. Returns 0 if the map is being stored. */
+int32_t heal_writev_map_store(call_frame_t * frame, xlator_t * xl, heal_write_local_t * local, heal_map_t * map, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    dict_t * dict;
+    void * data;
+    uint32_t length;
+
+    if ((heal_map_finish(map) != 0) ||
+        (heal_map_encode(map, &data, &length) != 0))
+    {
+        return EINVAL;
+    }
+
+    dict = dict_new();
+    if (dict == NULL)
+    {
+        GF_FREE(data);
+
+        return ENOMEM;
+    }
+    if (dict_set_bin(dict, HEAL_KEY_MAP, data, length) != 0)
+    {
+        GF_FREE(data);
+        dict_unref(dict);
+
+        return ENOMEM;
+    }
+
+    local->map = map;
+    local->result = result;
+    local->code = code;
+    local->attr_pre = *attr_pre;
+    local->attr_post = *attr_post;
+    local->xdata = (xdata != NULL) ? dict_ref(xdata) : NULL;
+
+    STACK_WIND_COOKIE(frame, heal_writev_map_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fsetxattr, local->fd, dict, 0, NULL);
+
+    dict_unref(dict);
+
+    return 0;
+}
+
+int32_t heal_writev_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    struct list_head stubs;
+    heal_private_t * priv;
+    heal_write_local_t * local;
+    heal_inode_ctx_t * inode_ctx;
+    heal_map_t * map;
+    uint64_t offset;
+    int32_t error;
+
+    INIT_LIST_HEAD(&stubs);
+
+    priv = xl->private;
+    local = cookie;
+    map = NULL;
+    offset = 0;
+
+    // Only one heal write can be in progress, so the map can be safely
+    // updated without holding the lock.
+    if ((result > 0) && (local->map != NULL))
+    {
+        heal_map_update(local->map, local->data, local->data_count, result);
+    }
+
+    LOCK(&local->inode->lock);
+
+    error = __heal_inode_ctx_get(&inode_ctx, xl, local->inode);
+    if (error == 0)
+    {
+        inode_ctx->heal_writing = 0;
+        if (result >= 0)
+        {
+            inode_ctx->offset += result;
+            inode_ctx->data_version++;
+            offset = inode_ctx->offset;
+            // Client writes already covered by the heal don't need to be
+            // merged anymore.
+            heal_ranges_trim(&inode_ctx->written, offset);
+            if ((inode_ctx->map != NULL) && (inode_ctx->offset >= inode_ctx->map->size))
+            {
+                map = inode_ctx->map;
+                inode_ctx->map = NULL;
+                // Any later modification of the data makes the map stale.
+                map->version = inode_ctx->data_version;
+            }
+        }
+        local->size = inode_ctx->size;
+        list_splice_init(&inode_ctx->write_stubs, &stubs);
+    }
+    else if (result >= 0)
+    {
+        code = error;
+        result = -1;
+    }
+
+    UNLOCK(&local->inode->lock);
+
+    if ((error == 0) && (result >= 0))
+    {
+        heal_registry_update(&priv->registry, local->inode->gfid, local->size, offset);
+        heal_trace(HEAL_TRACE_PROGRESS, local->inode->gfid, offset, result);
+        heal_generation_bump(xl, local->inode);
+    }
+
+    heal_stubs_resume(&stubs);
+
+    if (map != NULL)
+    {
+        if (heal_writev_map_store(frame, xl, local, map, result, code, attr_pre, attr_post, xdata) == 0)
+        {
+            return 0;
+        }
+
+        heal_map_destroy(map);
+    }
+
+    return heal_writev_unwind(frame, local, result, code, attr_pre, attr_post, xdata);
+}
+
+int32_t heal_writev_resume(call_frame_t * frame, xlator_t * xl, heal_write_local_t * local)
+{
+    STACK_WIND_COOKIE(frame, heal_writev_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->writev, local->fd, local->data, local->data_count, local->offset, local->flags, local->iobref, local->request);
+
+    return 0;
+}
+
+int32_t heal_writev_check_stat_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr, dict_t * xdata)
+{
+    heal_private_t * priv;
+    heal_write_local_t * local;
+    size_t length;
+
+    priv = xl->private;
+    local = cookie;
+    length = iov_length(local->data, local->data_count);
+
+    // The checksum of an area beyond the end of the file is computed as if
+    // it were filled with zeros, but the file still needs to be extended.
+    if ((result < 0) || (attr->ia_size < local->offset + length))
+    {
+        return heal_writev_resume(frame, xl, local);
+    }
+
+    __sync_fetch_and_add(&priv->check_skipped, 1);
+    __sync_fetch_and_add(&priv->check_skipped_bytes, length);
+
+    return heal_writev_cbk(frame, local, xl, length, 0, attr, attr, NULL);
+}
+
+int32_t heal_writev_check_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, uint32_t weak, uint8_t * strong, dict_t * xdata)
+{
+    heal_write_local_t * local;
+
+    local = cookie;
+
+    if ((result >= 0) && (strong != NULL) && (memcmp(strong, local->checksum, HEAL_CHECKSUM_SIZE) == 0))
+    {
+        STACK_WIND_COOKIE(frame, heal_writev_check_stat_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fstat, local->fd, NULL);
+
+        return 0;
+    }
+
+    return heal_writev_resume(frame, xl, local);
+}
+
+/* Compares the data already stored in the area of a heal write with the
+ * checksum sent by the healer. The data is only written if they differ. */
+int32_t heal_writev_check(call_frame_t * frame, xlator_t * xl, heal_write_local_t * local, off_t offset, uint32_t flags, struct iobref * iobref, dict_t * xdata)
+{
+    local->offset = offset;
+    local->flags = flags;
+    local->iobref = iobref_ref(iobref);
+    local->request = dict_ref(xdata);
+
+    STACK_WIND_COOKIE(frame, heal_writev_check_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->rchecksum, local->fd, offset, iov_length(local->data, local->data_count), NULL);
+
+    return 0;
+}
+
+int32_t heal_writev_journal_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    struct list_head stubs;
+    heal_inode_ctx_t * ctx;
+    inode_t * inode;
+
+    inode = cookie;
+    INIT_LIST_HEAD(&stubs);
+
+    LOCK(&inode->lock);
+
+    if ((__heal_inode_ctx_get(&ctx, xl, inode) == 0) && (--ctx->journal_pending == 0))
+    {
+        list_splice_init(&ctx->write_stubs, &stubs);
+    }
+
+    UNLOCK(&inode->lock);
+
+    // The recorded range may not contain the data of the client anymore,
+    // so the heal can't know which data to keep.
+    if (result < 0)
+    {
+        heal_inode_abort_healing(xl, inode, "a client write to the area not healed yet has failed");
+    }
+    else
+    {
+        heal_data_modified(xl, inode);
+    }
+
+    heal_stubs_resume(&stubs);
+
+    inode_unref(inode);
+
+    STACK_UNWIND_STRICT(writev, frame, result, code, attr_pre, attr_post, xdata);
+
+    return 0;
+}
+
+int32_t heal_writev_client_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+{
+    inode_t * inode;
+
+    inode = cookie;
+    if (result >= 0)
+    {
+        heal_data_modified(xl, inode);
+    }
+    inode_unref(inode);
+
+    STACK_UNWIND_STRICT(writev, frame, result, code, attr_pre, attr_post, xdata);
+
+    return 0;
+}
+
+/* Copies 'length' bytes starting at 'offset' of the data described by
+ * 'vector' into 'dst'. Returns the number of bytes copied. */
+size_t heal_iov_copy(void * dst, struct iovec * vector, int32_t count, size_t offset, size_t length)
+{
+    size_t copied, size;
+    int32_t i;
+
+    copied = 0;
+    for (i = 0; (i < count) && (copied < length); i++)
+    {
+        if (offset >= vector[i].iov_len)
+        {
+            offset -= vector[i].iov_len;
+
+            continue;
+        }
+        size = vector[i].iov_len - offset;
+        if (size > length - copied)
+        {
+            size = length - copied;
+        }
+        memcpy((char *)dst + copied, (char *)vector[i].iov_base + offset, size);
+        copied += size;
+        offset = 0;
+    }
+
+    return copied;
+}
+
+int32_t heal_writev_merge_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iovec * vector, int32_t count, struct iatt * attr, struct iobref * iobref, dict_t * xdata)
+{
+    heal_write_local_t * local;
+    heal_inode_ctx_t * ctx;
+    heal_range_t * range;
+    struct iobuf * iobuf;
+    struct iobref * merged;
+    uint64_t start, end, limit;
+    size_t length;
+    uint32_t i;
+    char * ptr;
+
+    local = cookie;
+
+    if (result < 0)
+    {
+        return heal_writev_cbk(frame, local, xl, -1, code, NULL, NULL, NULL);
+    }
+
+    length = iov_length(local->data, local->data_count);
+    iobuf = iobuf_get2(xl->ctx->iobuf_pool, length);
+    merged = iobref_new();
+    if ((iobuf == NULL) || (merged == NULL) || (iobref_add(merged, iobuf) != 0))
+    {
+        if (merged != NULL)
+        {
+            iobref_unref(merged);
+        }
+        if (iobuf != NULL)
+        {
+            iobuf_unref(iobuf);
+        }
+
+        return heal_writev_cbk(frame, local, xl, -1, ENOMEM, NULL, NULL, NULL);
+    }
+    ptr = iobuf_ptr(iobuf);
+    iov_unload(ptr, local->data, local->data_count);
+
+    // Client writes overlapping this area are delayed while the heal write
+    // is in progress, so the ranges and the data read can't change.
+    limit = local->offset + result;
+
+    LOCK(&local->inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, local->inode) == 0)
+    {
+        for (i = 0; i < ctx->written.count; i++)
+        {
+            range = &ctx->written.ranges[i];
+            start = (range->start > local->offset) ? range->start : local->offset;
+            end = (range->end < limit) ? range->end : limit;
+            if (start < end)
+            {
+                heal_iov_copy(ptr + (start - local->offset), vector, count, start - local->offset, end - start);
+            }
+        }
+    }
+
+    UNLOCK(&local->inode->lock);
+
+    local->merged.iov_base = ptr;
+    local->merged.iov_len = length;
+    local->data = &local->merged;
+    local->data_count = 1;
+    iobref_unref(local->iobref);
+    local->iobref = merged;
+    iobuf_unref(iobuf);
+
+    return heal_writev_resume(frame, xl, local);
+}
+
+/* Reads the data written by clients in the area of a heal write of a
+ * journal mode heal, and puts it over the heal data before writing it.
+ * Client data is always newer than the data read from the heal source. */
+int32_t heal_writev_merge(call_frame_t * frame, xlator_t * xl, heal_write_local_t * local, off_t offset, uint32_t flags, struct iobref * iobref, dict_t * xdata)
+{
+    local->offset = offset;
+    local->flags = flags;
+    local->iobref = iobref_ref(iobref);
+    local->request = (xdata != NULL) ? dict_ref(xdata) : NULL;
+
+    STACK_WIND_COOKIE(frame, heal_writev_merge_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->readv, local->fd, iov_length(local->data, local->data_count), offset, 0, NULL);
+
+    return 0;
+}
+
+int32_t heal_writev_discard_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr, dict_t * xdata)
+{
+    heal_write_local_t * local;
+    dict_t * reply;
+
+    local = cookie;
+
+    if (result < 0)
+    {
+        STACK_UNWIND_STRICT(writev, frame, -1, code, NULL, NULL, NULL);
+    }
+    else
+    {
+        reply = dict_new();
+        if (reply != NULL)
+        {
+            heal_dict_set_uint64_cow(&reply, HEAL_KEY_SIZE, local->size);
+        }
+
+        STACK_UNWIND_STRICT(writev, frame, local->length, 0, attr, attr, reply);
+
+        if (reply != NULL)
+        {
+            dict_unref(reply);
+        }
+    }
+
+    GF_FREE(local);
+
+    return 0;
+}
+
+/* Answers a heal write whose data is not needed anymore. Callers expect
+ * valid attributes in a successful write, so the file is stat'ed first. */
+int32_t heal_writev_discard(call_frame_t * frame, xlator_t * xl, fd_t * fd, size_t length, uint64_t size)
+{
+    heal_write_local_t * local;
+
+    local = GF_MALLOC(sizeof(heal_write_local_t), gf_heal_mt_heal_write_local_t);
+    if (local == NULL)
+    {
+        STACK_UNWIND_STRICT(writev, frame, -1, ENOMEM, NULL, NULL, NULL);
+
+        return 0;
+    }
+    local->length = length;
+    local->size = size;
+
+    STACK_WIND_COOKIE(frame, heal_writev_discard_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fstat, fd, NULL);
+
+    return 0;
+}
+
+int32_t heal_writev_decompress(call_frame_t * frame, xlator_t * xl, fd_t * fd, struct iovec * vector, int32_t count, off_t offset, uint32_t flags, struct iobref * iobref, dict_t * xdata, uint32_t algorithm);
+int32_t heal_writev_extents(call_frame_t * frame, xlator_t * xl, fd_t * fd, struct iovec * vector, int32_t count, off_t offset, uint32_t flags, struct iobref * iobref, dict_t * xdata, data_t * extents);
+
+int32_t heal_writev(call_frame_t * frame, xlator_t * xl, fd_t * fd, struct iovec * vector, int32_t count, off_t offset, uint32_t flags, struct iobref * iobref, dict_t * xdata)
+{
+    heal_private_t * priv;
+    heal_inode_ctx_t * inode_ctx;
+    heal_write_local_t * local;
+    heal_fd_ctx_t * fd_ctx;
+    void * data;
     uint64_t size;
-    uint32_t value;
-    int32_t healing, error;
+    size_t length;
+    dict_t * reply;
+    data_t * extents;
+    uint64_t healed;
+    uint32_t data_length, lease, algorithm, checksum_length, wait;
+    int32_t error, fd_healing, journaled, merge;
+
+    if ((xdata != NULL) && (heal_dict_get_uint32(xdata, HEAL_KEY_COMPRESS, &algorithm) == 0))
+    {
+        return heal_writev_decompress(frame, xl, fd, vector, count, offset, flags, iobref, xdata, algorithm);
+    }
+    if ((xdata != NULL) && ((extents = dict_get(xdata, HEAL_KEY_EXTENTS)) != NULL))
+    {
+        return heal_writev_extents(frame, xl, fd, vector, count, offset, flags, iobref, xdata, extents);
+    }
+
+    priv = xl->private;
+    length = iov_length(vector, count);
+    data = NULL;
+    wait = 0;
+    journaled = 0;
+
+    LOCK(&fd->inode->lock);
+
+    fd_healing = 0;
+    lease = 0;
+    error = __heal_inode_ctx_get(&inode_ctx, xl, fd->inode);
+    if (error == 0)
+    {
+        if (heal_fd_ctx_get(&fd_ctx, xl, fd) == 0)
+        {
+            fd_healing = fd_ctx->healing;
+            lease = fd_ctx->lease;
+        }
+        if (inode_ctx->healing == 0)
+        {
+            if (fd_healing != 0)
+            {
+                if (inode_ctx->aborted != 0)
+                {
+                    error = ENOENT;
+
+                    goto failed;
+                }
+
+                gf_log(xl->name, GF_LOG_ERROR, "Heal request to non healing file");
+
+                error = EPERM;
+
+                goto failed;
+            }
+        }
+        else
+        {
+            if (fd_healing == 0)
+            {
+                // Writes to healed areas or beyond the heal target (i.e.
+                // extending the file) are allowed.
+                healed = __heal_healed_end(priv, inode_ctx);
+                if ((healed < offset + length) && (inode_ctx->offset >= offset + length) && (inode_ctx->size > offset))
+                {
+                    __sync_fetch_and_add(&priv->unaligned_conflicts, 1);
+                }
+                if ((healed < offset + length) && (inode_ctx->size > offset) && (inode_ctx->journal != 0))
+                {
+                    // The heal write in progress could overwrite this data,
+                    // or share a unit with it.
+                    if ((inode_ctx->heal_writing != 0) && (offset < heal_granularity_round_up(priv, inode_ctx->heal_end)))
+                    {
+                        UNLOCK(&fd->inode->lock);
+
+                        error = heal_data_queue(xl, fd->inode, fop_writev_stub(frame, heal_writev, fd, vector, count, offset, flags, iobref, xdata), 0);
+                        if (error != 0)
+                        {
+                            goto failed_unlocked;
+                        }
+
+                        return 0;
+                    }
+                    journaled = 1;
+                }
+                else if ((healed < offset + length) && (inode_ctx->size > offset))
+                {
+                    gf_log(xl->name, GF_LOG_DEBUG, "Write to an area not healed yet (%lX - %lX)", offset, healed);
+
+                    wait = __heal_retry_estimate(inode_ctx, heal_granularity_round_up(priv, offset + length));
+                    error = EAGAIN;
+
+                    goto failed;
+                }
+                // Healed data is being modified. The integrity map won't be
+                // valid anymore.
+                if ((inode_ctx->map != NULL) && (offset < inode_ctx->size))
+                {
+                    inode_ctx->map->invalid = 1;
+                }
+            }
+            else
+            {
+                if (lease != inode_ctx->lease)
+                {
+                    gf_log(xl->name, GF_LOG_WARNING, "Heal of %s has been taken over by another healer", uuid_utoa(fd->inode->gfid));
+
+                    error = ESTALE;
+
+                    goto failed;
+                }
+                // Any heal request renews the lease, even if it has to wait.
+                inode_ctx->renewed = heal_now();
+
+                if ((inode_ctx->trunc_pending != 0) || (inode_ctx->journal_pending != 0))
+                {
+                    UNLOCK(&fd->inode->lock);
+
+                    error = heal_data_queue(xl, fd->inode, fop_writev_stub(frame, heal_writev, fd, vector, count, offset, flags, iobref, xdata), 1);
+                    if (error != 0)
+                    {
+                        goto failed_unlocked;
+                    }
+
+                    return 0;
+                }
+
+                size = inode_ctx->size;
+                if ((offset >= size) && (offset >= inode_ctx->offset))
+                {
+                    // The file has been truncated by a client. This data is
+                    // not needed anymore.
+                    UNLOCK(&fd->inode->lock);
+
+                    return heal_writev_discard(frame, xl, fd, length, size);
+                }
+                // A skip write declares that the area between the heal offset
+                // and the write already has valid contents.
+                if ((offset > inode_ctx->offset) && (xdata != NULL) && (dict_get(xdata, HEAL_KEY_SKIP) != NULL))
+                {
+                    if (inode_ctx->map != NULL)
+                    {
+                        inode_ctx->map->invalid = 1;
+                    }
+                    inode_ctx->offset = offset;
+                }
+                if (offset != inode_ctx->offset)
+                {
+                    gf_log(xl->name, GF_LOG_ERROR, "Bad offset healing (%lX - %lX)", offset, inode_ctx->offset);
+
+                    error = EPERM;
+
+                    goto failed;
+                }
+                // Only the last unit of the file can be partially written
+                // without forcing a read-modify-write on the brick.
+                if ((priv->granularity != 0) &&
+                    (((offset % priv->granularity) != 0) ||
+                     (((offset + length) % priv->granularity != 0) && (offset + length < size))))
+                {
+                    __sync_fetch_and_add(&priv->unaligned_writes, 1);
+                    __sync_fetch_and_add(&priv->unaligned_bytes, length);
+                }
+
+                local = GF_MALLOC(sizeof(heal_write_local_t), gf_heal_mt_heal_write_local_t);
+                if (local == NULL)
+                {
+                    error = ENOMEM;
+
+                    goto failed;
+                }
+                local->fd = fd;
+                local->vector = NULL;
+                local->count = 0;
+                local->length = length;
+                local->map = inode_ctx->map;
+                local->xdata = NULL;
+                local->iobref = NULL;
+                local->request = NULL;
+                checksum_length = sizeof(local->checksum);
+                local->check = (xdata != NULL) &&
+                               (heal_dict_get_bin(xdata, HEAL_KEY_CHECKSUM, local->checksum, &checksum_length) == 0) &&
+                               (checksum_length == sizeof(local->checksum));
+                merge = (inode_ctx->journal != 0) && heal_ranges_overlaps(&inode_ctx->written, offset, (offset + length > size) ? size : offset + length);
+                // Checked and merged writes are sent after this request has
+                // returned, so they need their own copy of the vector. The
+                // integrity map reads it once the write completes, which can
+                // also happen after returning, and the vector may belong to
+                // the caller's stack (i.e. decompressed writes).
+                if ((offset + length > size) || local->check || merge || (local->map != NULL))
+                {
+                    local->vector = GF_MALLOC(sizeof(struct iovec) * count, gf_heal_mt_iovec_t);
+                    if (local->vector == NULL)
+                    {
+                        GF_FREE(local);
+
+                        error = ENOMEM;
+
+                        goto failed;
+                    }
+                    local->count = heal_iov_trim(local->vector, vector, count, (offset + length > size) ? size - offset : length);
+                    vector = local->vector;
+                    count = local->count;
+                }
+                local->data = vector;
+                local->data_count = count;
+
+                inode_ctx->heal_writing = 1;
+                inode_ctx->heal_end = offset + iov_length(vector, count);
+                local->inode = inode_ref(fd->inode);
+
+                UNLOCK(&fd->inode->lock);
+
+                if (merge)
+                {
+                    return heal_writev_merge(frame, xl, local, offset, flags, iobref, xdata);
+                }
+                if (local->check)
+                {
+                    return heal_writev_check(frame, xl, local, offset, flags, iobref, xdata);
+                }
+
+                STACK_WIND_COOKIE(frame, heal_writev_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->writev, fd, vector, count, offset, flags, iobref, xdata);
+
+                return 0;
+            }
+        }
+    }
+
+    if (error == 0)
+    {
+        error = __heal_dirty_check(xl, inode_ctx, offset, offset + length, &data, &data_length);
+        if ((error == 0) && journaled)
+        {
+            error = __heal_journal_add(inode_ctx, offset, offset + length);
+            if (error == EAGAIN)
+            {
+                wait = __heal_retry_estimate(inode_ctx, offset + length);
+
+                goto failed;
+            }
+        }
+
+        UNLOCK(&fd->inode->lock);
+
+        if (error == 0)
+        {
+            heal_heat_account(&priv->heat, fd->inode->gfid, HEAL_HEAT_WRITE, length);
+
+            if (journaled)
+            {
+                STACK_WIND_COOKIE(frame, heal_writev_journal_cbk, inode_ref(fd->inode), FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->writev, fd, vector, count, offset, flags, iobref, xdata);
+
+                return 0;
+            }
+
+            STACK_WIND_COOKIE(frame, heal_writev_client_cbk, inode_ref(fd->inode), FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->writev, fd, vector, count, offset, flags, iobref, xdata);
+
+            return 0;
+        }
+        if ((error == EINPROGRESS) || (error == EAGAIN))
+        {
+            error = heal_dirty_defer(frame, xl, fd->inode, NULL, fd, error, data, data_length, fop_writev_stub(frame, heal_writev, fd, vector, count, offset, flags, iobref, xdata), heal_dirty_fail_writev);
+            if (error == 0)
+            {
+                return 0;
+            }
+        }
+
+        goto failed_unlocked;
+    }
+
+failed:
+    UNLOCK(&fd->inode->lock);
+
+failed_unlocked:
+    reply = NULL;
+    if (error == EAGAIN)
+    {
+        heal_trace(HEAL_TRACE_REJECT, fd->inode->gfid, offset, offset + length);
+
+        reply = heal_retry_xdata(wait);
+    }
+
+    STACK_UNWIND_STRICT(writev, frame, -1, error, NULL, NULL, reply);
+
+    if (reply != NULL)
+    {
+        dict_unref(reply);
+    }
+
+    return 0;
+}
+
+/* Decompresses a compressed heal write into a pooled iobuf and processes
+ * it as a normal heal write. */
+int32_t heal_writev_decompress(call_frame_t * frame, xlator_t * xl, fd_t * fd, struct iovec * vector, int32_t count, off_t offset, uint32_t flags, struct iobref * iobref, dict_t * xdata, uint32_t algorithm)
+{
+    heal_private_t * priv;
+    heal_fd_ctx_t * fd_ctx;
+    struct iobuf * iobuf;
+    struct iobref * raw_iobref;
+    struct iovec raw;
+    struct timespec start, end;
+    uint64_t size, usecs;
+    size_t length;
+    void * src;
+    int32_t error;
 
-    error = 0;
-    healing = 0;
-    size = 0;
-    if (xdata != NULL)
+    priv = xl->private;
+    iobuf = NULL;
+    raw_iobref = NULL;
+    src = NULL;
+    length = iov_length(vector, count);
+
+    if ((heal_fd_ctx_get(&fd_ctx, xl, fd) != 0) || (fd_ctx->healing == 0))
     {
-        if (heal_dict_get_uint32(xdata, HEAL_KEY_FLAGS, &value) == 0)
+        gf_log(xl->name, GF_LOG_ERROR, "Compressed write to a non healing file descriptor");
+
+        error = EINVAL;
+
+        goto failed;
+    }
+    if (!heal_compress_supported(algorithm))
+    {
+        error = EOPNOTSUPP;
+
+        goto failed;
+    }
+    if ((heal_dict_get_uint64(xdata, HEAL_KEY_RAW_SIZE, &size) != 0) || (size == 0) || (size > HEAL_COMPRESS_MAX_SIZE))
+    {
+        error = EINVAL;
+
+        goto failed;
+    }
+
+    iobuf = iobuf_get2(xl->ctx->iobuf_pool, size);
+    raw_iobref = iobref_new();
+    if ((iobuf == NULL) || (raw_iobref == NULL) || (iobref_add(raw_iobref, iobuf) != 0))
+    {
+        error = ENOMEM;
+
+        goto failed;
+    }
+
+    // Decompressors need contiguous input.
+    src = vector[0].iov_base;
+    if (count > 1)
+    {
+        src = GF_MALLOC(length, gf_heal_mt_uint8_t);
+        if (src == NULL)
         {
-            if (value != 0)
-            {
-                if (heal_dict_get_uint64(xdata, HEAL_KEY_SIZE, &size) == 0)
-                {
-                    healing = 1;
-                }
-                else
-                {
-                    error = EIO;
-                }
-            }
+            error = ENOMEM;
+
+            goto failed;
         }
+        iov_unload(src, vector, count);
     }
-    gf_log(xl->name, GF_LOG_DEBUG, "Heal create: %u, error=%d", healing, error);
-    if (error == 0)
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    error = heal_decompress(algorithm, src, length, iobuf_ptr(iobuf), size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (count > 1)
     {
-        error = heal_inode_ctx_new(&ctx, xl, loc->inode, healing, size);
-        if (error == 0)
+        GF_FREE(src);
+    }
+
+    usecs = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    heal_compress_account(&priv->compress, length, size, usecs, error);
+    if (error != 0)
+    {
+        gf_log(xl->name, GF_LOG_ERROR, "Unable to decompress heal data of %s at offset %lu", uuid_utoa(fd->inode->gfid), offset);
+
+        goto failed;
+    }
+
+    // The decompressed request must not be decompressed again if it needs
+    // to be delayed.
+    xdata = dict_ref(xdata);
+    if ((heal_dict_del_cow(&xdata, HEAL_KEY_COMPRESS) != 0) || (heal_dict_del_cow(&xdata, HEAL_KEY_RAW_SIZE) != 0))
+    {
+        dict_unref(xdata);
+
+        error = ENOMEM;
+
+        goto failed;
+    }
+
+    raw.iov_base = iobuf_ptr(iobuf);
+    raw.iov_len = size;
+
+    heal_writev(frame, xl, fd, &raw, 1, offset, flags, raw_iobref, xdata);
+
+    dict_unref(xdata);
+    iobref_unref(raw_iobref);
+    iobuf_unref(iobuf);
+
+    return 0;
+
+failed:
+    if (raw_iobref != NULL)
+    {
+        iobref_unref(raw_iobref);
+    }
+    if (iobuf != NULL)
+    {
+        iobuf_unref(iobuf);
+    }
+
+    STACK_UNWIND_STRICT(writev, frame, -1, error, NULL, NULL, NULL);
+
+    return 0;
+}
+
+/* Fills 'dst' with the area [offset, offset + length) of 'vector'. Returns
+ * the number of entries used. */
+int32_t heal_iov_slice(struct iovec * dst, struct iovec * vector, int32_t count, size_t offset, size_t length)
+{
+    size_t size;
+    int32_t i, n;
+
+    n = 0;
+    for (i = 0; (i < count) && (length > 0); i++)
+    {
+        if (offset >= vector[i].iov_len)
         {
-            STACK_WIND_COOKIE(frame, heal_create_cbk, healing ? inode_ref(loc->inode) : NULL, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->create, loc, flags, mode, umask, fd, xdata);
+            offset -= vector[i].iov_len;
 
-            return 0;
+            continue;
+        }
+
+        size = vector[i].iov_len - offset;
+        if (size > length)
+        {
+            size = length;
         }
+        dst[n].iov_base = (char *)vector[i].iov_base + offset;
+        dst[n].iov_len = size;
+        n++;
+
+        length -= size;
+        offset = 0;
     }
 
-    STACK_UNWIND_STRICT(create, frame, -1, error, NULL, NULL, NULL, NULL, NULL, NULL);
+    return n;
+}
+
+void heal_extents_local_free(heal_extents_local_t * local)
+{
+    LOCK_DESTROY(&local->lock);
+    fd_unref(local->fd);
+    if (local->iobref != NULL)
+    {
+        iobref_unref(local->iobref);
+    }
+    if (local->request != NULL)
+    {
+        dict_unref(local->request);
+    }
+    if (local->reply != NULL)
+    {
+        dict_unref(local->reply);
+    }
+    GF_FREE(local->vector);
+    GF_FREE(local->slice);
+    GF_FREE(local->extents);
+    GF_FREE(local->results);
+    GF_FREE(local);
+}
+
+int32_t heal_writev_extents_unwind(call_frame_t * frame, heal_extents_local_t * local)
+{
+    uint32_t i;
+    int32_t result;
+
+    // Extents not processed because of a previous failure are reported as
+    // cancelled.
+    for (i = local->index; i < local->number; i++)
+    {
+        local->results[i] = htonl(ECANCELED);
+    }
+
+    local->reply = heal_xdata_ref(local->reply);
+    if ((local->reply != NULL) && (heal_dict_set_bin_cow(&local->reply, HEAL_KEY_EXTENT_RESULTS, local->results, sizeof(int32_t) * local->number) == 0))
+    {
+        // The dict now owns the results.
+        local->results = NULL;
+    }
+
+    result = (local->code == 0) ? iov_length(local->vector, local->count) : -1;
+
+    STACK_UNWIND_STRICT(writev, frame, result, local->code, &local->attr_pre, &local->attr_post, local->reply);
+
+    heal_extents_local_free(local);
 
     return 0;
 }
 
-int32_t heal_getxattr(call_frame_t * frame, xlator_t * xl, loc_t * loc, const char * name, dict_t * xdata)
+int32_t heal_writev_extents_next(call_frame_t * frame, xlator_t * xl, heal_extents_local_t * local);
+
+int32_t heal_writev_extents_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
 {
-    int32_t error;
+    heal_extents_local_t * local;
+    int32_t winding;
 
-    error = heal_inode_ctx_check(xl, loc->inode);
-    if (error == 0)
+    local = cookie;
+
+    if (local->reply != NULL)
     {
-        STACK_WIND(frame, default_getxattr_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->getxattr, loc, name, xdata);
+        dict_unref(local->reply);
+    }
+    local->reply = (xdata != NULL) ? dict_ref(xdata) : NULL;
+
+    if (result < 0)
+    {
+        local->results[local->index] = htonl(code);
+        local->code = code;
+    }
+    else
+    {
+        if ((local->index == 0) && (attr_pre != NULL))
+        {
+            local->attr_pre = *attr_pre;
+        }
+        if (attr_post != NULL)
+        {
+            local->attr_post = *attr_post;
+        }
+        local->results[local->index] = 0;
+        local->position += ntoh64(local->extents[local->index].length);
+    }
+    local->index++;
 
+    // If the write has completed before returning from the wind, the loop
+    // in heal_writev_extents_next() sends the next extent.
+    LOCK(&local->lock);
+
+    winding = local->winding;
+    local->completed = winding;
+
+    UNLOCK(&local->lock);
+
+    // 'local' can be released by the loop once the lock is released.
+    if (winding)
+    {
         return 0;
     }
 
-    STACK_UNWIND_STRICT(getxattr, frame, -1, error, NULL, NULL);
+    return heal_writev_extents_next(frame, xl, local);
+}
+
+/* Sends the remaining extents as skip heal writes through this translator,
+ * so that they follow the same checks as any other heal write. Writes that
+ * complete synchronously are continued by this loop instead of recursing
+ * from the callback. */
+int32_t heal_writev_extents_next(call_frame_t * frame, xlator_t * xl, heal_extents_local_t * local)
+{
+    uint64_t offset, length;
+    int32_t count, completed;
+
+    do
+    {
+        if ((local->code != 0) || (local->index >= local->number))
+        {
+            return heal_writev_extents_unwind(frame, local);
+        }
+
+        offset = ntoh64(local->extents[local->index].offset);
+        length = ntoh64(local->extents[local->index].length);
+        count = heal_iov_slice(local->slice, local->vector, local->count, local->position, length);
+
+        LOCK(&local->lock);
+
+        local->winding = 1;
+        local->completed = 0;
+
+        UNLOCK(&local->lock);
+
+        STACK_WIND_COOKIE(frame, heal_writev_extents_cbk, local, xl, xl->fops->writev, local->fd, local->slice, count, offset, local->flags, local->iobref, local->request);
+
+        LOCK(&local->lock);
+
+        local->winding = 0;
+        completed = local->completed;
+
+        UNLOCK(&local->lock);
+    } while (completed);
 
     return 0;
 }
 
-int32_t heal_fgetxattr(call_frame_t * frame, xlator_t * xl, fd_t * fd, const char * name, dict_t * xdata)
+/* Applies a multi-extent heal write. The payload contains the data of all
+ * extents packed in order. Extents must be sorted and not overlap, and the
+ * areas between them must already be valid. */
+int32_t heal_writev_extents(call_frame_t * frame, xlator_t * xl, fd_t * fd, struct iovec * vector, int32_t count, off_t offset, uint32_t flags, struct iobref * iobref, dict_t * xdata, data_t * extents)
 {
+    heal_extents_local_t * local;
+    heal_fd_ctx_t * fd_ctx;
+    uint64_t start, length, end, total;
+    uint32_t i, number;
     int32_t error;
 
-    error = heal_inode_ctx_check(xl, fd->inode);
-    if (error == 0)
+    local = NULL;
+
+    if ((heal_fd_ctx_get(&fd_ctx, xl, fd) != 0) || (fd_ctx->healing == 0))
     {
-        STACK_WIND(frame, default_fgetxattr_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fgetxattr, fd, name, xdata);
+        gf_log(xl->name, GF_LOG_ERROR, "Multi-extent write to a non healing file descriptor");
 
-        return 0;
+        error = EINVAL;
+
+        goto failed;
+    }
+
+    number = extents->len / sizeof(heal_extent_t);
+    if ((number == 0) || (number > HEAL_EXTENTS_MAX) || (extents->len != number * sizeof(heal_extent_t)))
+    {
+        error = EINVAL;
+
+        goto failed;
+    }
+
+    local = GF_CALLOC(1, sizeof(heal_extents_local_t), gf_heal_mt_heal_extents_local_t);
+    if (local == NULL)
+    {
+        error = ENOMEM;
+
+        goto failed;
+    }
+    LOCK_INIT(&local->lock);
+    local->fd = fd_ref(fd);
+    local->extents = GF_MALLOC(extents->len, gf_heal_mt_uint8_t);
+    local->results = GF_MALLOC(sizeof(int32_t) * number, gf_heal_mt_uint8_t);
+    local->vector = GF_MALLOC(sizeof(struct iovec) * count, gf_heal_mt_iovec_t);
+    local->slice = GF_MALLOC(sizeof(struct iovec) * count, gf_heal_mt_iovec_t);
+    if ((local->extents == NULL) || (local->results == NULL) || (local->vector == NULL) || (local->slice == NULL))
+    {
+        error = ENOMEM;
+
+        goto failed;
+    }
+    memcpy(local->extents, extents->data, extents->len);
+    local->number = number;
+
+    end = offset;
+    total = 0;
+    for (i = 0; i < number; i++)
+    {
+        start = ntoh64(local->extents[i].offset);
+        length = ntoh64(local->extents[i].length);
+        if ((length == 0) || (start < end) || (start + length < start))
+        {
+            error = EINVAL;
+
+            goto failed;
+        }
+        end = start + length;
+        total += length;
     }
+    if ((ntoh64(local->extents[0].offset) != offset) || (total != iov_length(vector, count)))
+    {
+        error = EINVAL;
+
+        goto failed;
+    }
+
+    // The data is owned by the iobref, so only the vector needs to be kept.
+    memcpy(local->vector, vector, sizeof(struct iovec) * count);
+    local->count = count;
+    local->flags = flags;
+    local->iobref = (iobref != NULL) ? iobref_ref(iobref) : NULL;
+
+    // Each extent is sent as a skip write. The checksum, if any, refers to
+    // the whole payload and can't be checked.
+    local->request = dict_ref(xdata);
+    if ((heal_dict_del_cow(&local->request, HEAL_KEY_EXTENTS) != 0) ||
+        (heal_dict_del_cow(&local->request, HEAL_KEY_CHECKSUM) != 0) ||
+        (heal_dict_set_uint32_cow(&local->request, HEAL_KEY_SKIP, 1) != 0))
+    {
+        error = ENOMEM;
+
+        goto failed;
+    }
+
+    return heal_writev_extents_next(frame, xl, local);
 
-    STACK_UNWIND_STRICT(fgetxattr, frame, -1, error, NULL, NULL);
+failed:
+    if (local != NULL)
+    {
+        heal_extents_local_free(local);
+    }
+
+    STACK_UNWIND_STRICT(writev, frame, -1, error, NULL, NULL, NULL);
 
     return 0;
 }
 
-int32_t heal_lookup(call_frame_t * frame, xlator_t * xl, loc_t * loc, dict_t * xdata)
+/* Ends a heal commit and resumes the next one, if any. */
+void heal_commit_end(xlator_t * xl, inode_t * inode)
 {
+    struct list_head stubs;
     heal_inode_ctx_t * ctx;
-    int32_t error;
 
-    error = heal_inode_ctx_new(&ctx, xl, loc->inode, 0, 0);
-    if (error == 0)
+    INIT_LIST_HEAD(&stubs);
+
+    LOCK(&inode->lock);
+
+    if (__heal_inode_ctx_get(&ctx, xl, inode) == 0)
     {
-        STACK_WIND(frame, default_lookup_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->lookup, loc, xdata);
+        ctx->committing = 0;
+        list_splice_init(&ctx->commit_stubs, &stubs);
+    }
 
-        return 0;
+    UNLOCK(&inode->lock);
+
+    heal_stubs_resume(&stubs);
+}
+
+void heal_xattrop_local_free(heal_xattrop_local_t * local)
+{
+    if (local->reply != NULL)
+    {
+        dict_unref(local->reply);
+    }
+    if (local->dict != NULL)
+    {
+        dict_unref(local->dict);
+    }
+    if (local->xdata != NULL)
+    {
+        dict_unref(local->xdata);
     }
+    GF_FREE(local);
+}
 
-    STACK_UNWIND_STRICT(lookup, frame, -1, error, NULL, NULL, NULL, NULL);
+/* Answers a heal commit. 'local' is released. */
+void heal_fxattrop_unwind(call_frame_t * frame, xlator_t * xl, heal_xattrop_local_t * local, int32_t result, int32_t code, dict_t * dict, dict_t * xdata)
+{
+    inode_t * inode;
+
+    // The fd could be released as soon as the request is answered.
+    inode = inode_ref(local->fd->inode);
+    if (local->tracked != NULL)
+    {
+        heal_meta_client_end(xl, local->tracked);
+        local->tracked = NULL;
+    }
+
+    STACK_UNWIND_STRICT(fxattrop, frame, result, code, dict, xdata);
+
+    heal_xattrop_local_free(local);
+
+    heal_commit_end(xl, inode);
+    inode_unref(inode);
+}
+
+int32_t heal_fxattrop_progress_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * xdata)
+{
+    heal_xattrop_local_t * local;
+
+    local = cookie;
+
+    // The markers have already been updated. A missing or stale progress
+    // only means that more data will be healed again if the heal is
+    // interrupted.
+    if ((result < 0) && ((local->done == 0) || (code != ENODATA)))
+    {
+        gf_log(xl->name, GF_LOG_WARNING, "Unable to store the heal progress of %s (%d)", uuid_utoa(local->fd->inode->gfid), code);
+    }
+
+    heal_fxattrop_unwind(frame, xl, local, 0, 0, local->reply, NULL);
 
     return 0;
 }
 
-int32_t heal_rchecksum(call_frame_t * frame, xlator_t * xl, fd_t * fd, off_t offset, int32_t len, dict_t * xdata)
+int32_t heal_fxattrop_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * dict, dict_t * xdata)
 {
-    int32_t error;
+    heal_xattrop_local_t * local;
+    heal_inode_ctx_t * ctx;
+    dict_t * progress;
 
-    error = heal_inode_ctx_check_range(xl, fd->inode, offset, offset + len);
-    if (error == 0)
+    local = cookie;
+
+    if (local->tracked != NULL)
     {
-        STACK_WIND(frame, default_rchecksum_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->rchecksum, fd, offset, len, xdata);
+        heal_meta_client_end(xl, local->tracked);
+        local->tracked = NULL;
+    }
+
+    if (result < 0)
+    {
+        heal_fxattrop_unwind(frame, xl, local, result, code, dict, xdata);
 
         return 0;
     }
 
-    STACK_UNWIND_STRICT(rchecksum, frame, -1, error, 0, NULL, NULL);
+    LOCK(&local->fd->inode->lock);
 
-    return error;
-}
+    if ((__heal_inode_ctx_get(&ctx, xl, local->fd->inode) == 0) && (ctx->committed < local->offset))
+    {
+        ctx->committed = local->offset;
+    }
 
-int32_t heal_readv(call_frame_t * frame, xlator_t * xl, fd_t * fd, size_t size, off_t offset, uint32_t flags, dict_t * xdata)
-{
-    int32_t error;
+    UNLOCK(&local->fd->inode->lock);
 
-    error = heal_inode_ctx_check_range(xl, fd->inode, offset, offset + size);
-    if (error == 0)
+    heal_trace(HEAL_TRACE_COMMIT, local->fd->inode->gfid, local->offset, local->done);
+
+    if (dict != NULL)
     {
-        STACK_WIND(frame, default_readv_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->readv, fd, size, offset, flags, xdata);
+        local->reply = dict_ref(dict);
+    }
+
+    if (local->done)
+    {
+        STACK_WIND_COOKIE(frame, heal_fxattrop_progress_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fremovexattr, local->fd, HEAL_KEY_PROGRESS, NULL);
 
         return 0;
     }
 
-    STACK_UNWIND_STRICT(readv, frame, -1, error, NULL, 0, NULL, NULL, NULL);
+    progress = dict_new();
+    if ((progress == NULL) || (heal_dict_set_uint64_cow(&progress, HEAL_KEY_PROGRESS, local->offset) != 0))
+    {
+        if (progress != NULL)
+        {
+            dict_unref(progress);
+        }
 
-    return error;
+        gf_log(xl->name, GF_LOG_WARNING, "Unable to store the heal progress of %s (%d)", uuid_utoa(local->fd->inode->gfid), ENOMEM);
+
+        heal_fxattrop_unwind(frame, xl, local, 0, 0, local->reply, NULL);
+
+        return 0;
+    }
+
+    STACK_WIND_COOKIE(frame, heal_fxattrop_progress_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fsetxattr, local->fd, progress, 0, NULL);
+
+    dict_unref(progress);
+
+    return 0;
 }
 
-int32_t heal_stat(call_frame_t * frame, xlator_t * xl, loc_t * loc, dict_t * xdata)
+int32_t heal_fxattrop_fsync_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
 {
-    int32_t error;
+    heal_xattrop_local_t * local;
 
-    error = heal_inode_ctx_check(xl, loc->inode);
-    if (error == 0)
+    local = cookie;
+
+    // The progress can't be stored if the data it covers is not stable.
+    if (result < 0)
     {
-        STACK_WIND(frame, default_stat_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->stat, loc, xdata);
+        gf_log(xl->name, GF_LOG_WARNING, "Unable to flush the healed data of %s (%d)", uuid_utoa(local->fd->inode->gfid), code);
+
+        heal_fxattrop_unwind(frame, xl, local, -1, code, NULL, NULL);
 
         return 0;
     }
 
-    STACK_UNWIND_STRICT(stat, frame, -1, error, NULL, NULL);
+    STACK_WIND_COOKIE(frame, heal_fxattrop_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fxattrop, local->fd, local->optype, local->dict, local->xdata);
 
     return 0;
 }
 
-int32_t heal_fstat(call_frame_t * frame, xlator_t * xl, fd_t * fd, dict_t * xdata)
-{
-    int32_t error;
-
-    error = heal_inode_ctx_check(xl, fd->inode);
-    if (error == 0)
+int32_t heal_fxattrop_client_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * dict, dict_t * xdata)
+{
+    if (cookie != NULL)
     {
-        STACK_WIND(frame, default_fstat_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fstat, fd, xdata);
-
-        return 0;
+        heal_meta_client_end(xl, cookie);
     }
 
-    STACK_UNWIND_STRICT(fstat, frame, -1, error, NULL, NULL);
+    STACK_UNWIND_STRICT(fxattrop, frame, result, code, dict, xdata);
 
     return 0;
 }
 
-int32_t heal_truncate_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+/* An fxattrop sent by a healer with HEAL_KEY_OFFSET commits the data healed
+ * up to that offset: the data is flushed, the pending markers are updated
+ * as requested and the offset is stored in HEAL_KEY_PROGRESS, so that an
+ * interrupted heal can be resumed from it. The progress is removed once the
+ * whole file has been committed. Commits of an inode are serialized. Like
+ * any other xattr change, xattrops wait for metadata heals and change the
+ * metadata version. */
+int32_t heal_fxattrop(call_frame_t * frame, xlator_t * xl, fd_t * fd, gf_xattrop_flags_t optype, dict_t * dict, dict_t * xdata)
 {
-    inode_t * inode;
-    heal_inode_ctx_t * inode_ctx;
-    int32_t error;
+    heal_xattrop_local_t * local;
+    heal_inode_ctx_t * ctx;
+    heal_fd_ctx_t * fd_ctx;
+    call_stub_t * stub;
+    uint64_t offset;
+    int32_t error, done, tracked;
 
-    inode = cookie;
-    if (result >= 0)
+    if ((xdata == NULL) || (heal_dict_get_uint64(xdata, HEAL_KEY_OFFSET, &offset) != 0))
     {
-        LOCK(&inode->lock);
-
-        error = __heal_inode_ctx_get(&inode_ctx, xl, inode);
+        error = heal_meta_client_begin(xl, fd->inode, &tracked);
         if (error == 0)
         {
-            if (inode_ctx->healing == 1)
-            {
-                if (inode_ctx->size > attr_post->ia_size)
-                {
-                    inode_ctx->size = attr_post->ia_size;
-                }
-            }
-        }
-        else
-        {
-            code = error;
-            result = -1;
+            STACK_WIND_COOKIE(frame, heal_fxattrop_client_cbk, tracked ? inode_ref(fd->inode) : NULL, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fxattrop, fd, optype, dict, xdata);
+
+            return 0;
         }
 
-        UNLOCK(&inode->lock);
+        goto queue;
     }
 
-    inode_unref(inode);
+    if ((heal_fd_ctx_get(&fd_ctx, xl, fd) != 0) || (fd_ctx->healing == 0))
+    {
+        gf_log(xl->name, GF_LOG_ERROR, "Heal commit from a non healing file descriptor");
 
-    STACK_UNWIND_STRICT(truncate, frame, result, code, attr_pre, attr_post, xdata);
+        error = EINVAL;
 
-    return 0;
-}
+        goto failed;
+    }
 
-int32_t heal_truncate(call_frame_t * frame, xlator_t * xl, loc_t * loc, off_t offset, dict_t * xdata)
-{
-    STACK_WIND_COOKIE(frame, heal_truncate_cbk, inode_ref(loc->inode), FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->truncate, loc, offset, xdata);
+    error = heal_meta_client_begin(xl, fd->inode, &tracked);
+    if (error != 0)
+    {
+        goto queue;
+    }
 
-    return 0;
-}
+    done = 0;
 
-int32_t heal_ftruncate_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
-{
-    inode_t * inode;
-    heal_inode_ctx_t * inode_ctx;
-    int32_t error;
+    LOCK(&fd->inode->lock);
 
-    inode = cookie;
-    if (result >= 0)
+    error = __heal_inode_ctx_get(&ctx, xl, fd->inode);
+    if ((error == 0) && (ctx->committing != 0))
     {
-        LOCK(&inode->lock);
+        // Another commit is in progress. This one will be checked again
+        // once it finishes, so that 'committed' never goes back.
+        stub = fop_fxattrop_stub(frame, heal_fxattrop, fd, optype, dict, xdata);
+        if (stub != NULL)
+        {
+            list_add_tail(&stub->list, &ctx->commit_stubs);
+        }
+        else
+        {
+            error = ENOMEM;
+        }
 
-        error = __heal_inode_ctx_get(&inode_ctx, xl, inode);
-        if (error == 0)
+        UNLOCK(&fd->inode->lock);
+
+        if (tracked)
         {
-            if (inode_ctx->healing == 1)
-            {
-                if (inode_ctx->size > attr_post->ia_size)
-                {
-                    inode_ctx->size = attr_post->ia_size;
-                }
-            }
+            heal_meta_client_end(xl, inode_ref(fd->inode));
+        }
+        if (error != 0)
+        {
+            goto failed;
+        }
+
+        return 0;
+    }
+    if (error == 0)
+    {
+        if ((ctx->healing == 0) || (ctx->lease != fd_ctx->lease))
+        {
+            error = ESTALE;
+        }
+        else if ((offset > ctx->offset) || (offset < ctx->committed))
+        {
+            // Only data already written can be committed, and never twice.
+            error = EINVAL;
         }
         else
         {
-            code = error;
-            result = -1;
+            ctx->renewed = heal_now();
+            ctx->committing = 1;
+            done = (offset >= ctx->size);
         }
+    }
 
-        UNLOCK(&inode->lock);
+    UNLOCK(&fd->inode->lock);
+
+    if (error != 0)
+    {
+        gf_log(xl->name, GF_LOG_WARNING, "Bad heal commit of %s at offset %lu (%d)", uuid_utoa(fd->inode->gfid), offset, error);
+
+        if (tracked)
+        {
+            heal_meta_client_end(xl, inode_ref(fd->inode));
+        }
+
+        goto failed;
     }
 
-    inode_unref(inode);
+    local = GF_CALLOC(1, sizeof(heal_xattrop_local_t), gf_heal_mt_heal_xattrop_local_t);
+    if (local == NULL)
+    {
+        if (tracked)
+        {
+            heal_meta_client_end(xl, inode_ref(fd->inode));
+        }
+        heal_commit_end(xl, fd->inode);
 
-    STACK_UNWIND_STRICT(ftruncate, frame, result, code, attr_pre, attr_post, xdata);
+        error = ENOMEM;
 
-    return 0;
-}
+        goto failed;
+    }
+    local->fd = fd;
+    local->tracked = tracked ? inode_ref(fd->inode) : NULL;
+    local->offset = offset;
+    local->done = done;
+    local->optype = optype;
+    local->dict = (dict != NULL) ? dict_ref(dict) : NULL;
+    local->xdata = dict_ref(xdata);
 
-int32_t heal_ftruncate(call_frame_t * frame, xlator_t * xl, fd_t * fd, off_t offset, dict_t * xdata)
-{
-    STACK_WIND_COOKIE(frame, heal_ftruncate_cbk, inode_ref(fd->inode), FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->ftruncate, fd, offset, xdata);
+    STACK_WIND_COOKIE(frame, heal_fxattrop_fsync_cbk, local, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->fsync, fd, 1, NULL);
 
     return 0;
-}
-
-int32_t heal_unlink_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_ppre, struct iatt * attr_ppost, dict_t * xdata)
-{
-    inode_t * inode;
-    heal_inode_ctx_t * inode_ctx;
-    int32_t error;
 
-    inode = cookie;
-    if (result >= 0)
+queue:
+    if (error == EINPROGRESS)
     {
-        LOCK(&inode->lock);
-
-        error = __heal_inode_ctx_get(&inode_ctx, xl, inode);
+        error = heal_meta_client_queue(xl, fd->inode, fop_fxattrop_stub(frame, heal_fxattrop, fd, optype, dict, xdata));
         if (error == 0)
         {
-            // TODO: if the removed link was the last one, any healing in
-            //       progress should be cancelled.
-        }
-        else
-        {
-            code = error;
-            result = -1;
+            return 0;
         }
-
-        UNLOCK(&inode->lock);
     }
 
-    inode_unref(inode);
-
-    STACK_UNWIND_STRICT(unlink, frame, result, code, attr_ppre, attr_ppost, xdata);
+failed:
+    STACK_UNWIND_STRICT(fxattrop, frame, -1, error, NULL, NULL);
 
     return 0;
 }
 
-int32_t heal_unlink(call_frame_t * frame, xlator_t * xl, loc_t * loc, int xflags, dict_t * xdata)
+int32_t heal_xattrop_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, dict_t * dict, dict_t * xdata)
 {
-    STACK_WIND_COOKIE(frame, heal_unlink_cbk, inode_ref(loc->inode), FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->unlink, loc, xflags, xdata);
+    if (cookie != NULL)
+    {
+        heal_meta_client_end(xl, cookie);
+    }
+
+    STACK_UNWIND_STRICT(xattrop, frame, result, code, dict, xdata);
 
     return 0;
 }
 
-int32_t heal_writev_cbk(call_frame_t * frame, void * cookie, xlator_t * xl, int32_t result, int32_t code, struct iatt * attr_pre, struct iatt * attr_post, dict_t * xdata)
+int32_t heal_xattrop(call_frame_t * frame, xlator_t * xl, loc_t * loc, gf_xattrop_flags_t optype, dict_t * dict, dict_t * xdata)
 {
-    heal_inode_ctx_t * inode_ctx;
-    inode_t * inode;
-    int32_t error;
+    int32_t error, tracked;
 
-    inode = cookie;
-    if (result >= 0)
+    // Heal commits need the lease of the healing fd.
+    if ((xdata != NULL) && (dict_get(xdata, HEAL_KEY_OFFSET) != NULL))
     {
-        LOCK(&inode->lock);
+        error = EINVAL;
 
-        error = __heal_inode_ctx_get(&inode_ctx, xl, inode);
+        goto failed;
+    }
+
+    error = heal_meta_client_begin(xl, loc->inode, &tracked);
+    if (error == 0)
+    {
+        STACK_WIND_COOKIE(frame, heal_xattrop_cbk, tracked ? inode_ref(loc->inode) : NULL, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->xattrop, loc, optype, dict, xdata);
+
+        return 0;
+    }
+    if (error == EINPROGRESS)
+    {
+        error = heal_meta_client_queue(xl, loc->inode, fop_xattrop_stub(frame, heal_xattrop, loc, optype, dict, xdata));
         if (error == 0)
         {
-            inode_ctx->offset += result;
-        }
-        else
-        {
-            code = error;
-            result = -1;
+            return 0;
         }
-
-        UNLOCK(&inode->lock);
     }
-    inode_unref(inode);
 
-    STACK_UNWIND_STRICT(writev, frame, result, code, attr_pre, attr_post, xdata);
+failed:
+    STACK_UNWIND_STRICT(xattrop, frame, -1, error, NULL, NULL);
 
     return 0;
 }
 
-int32_t heal_writev(call_frame_t * frame, xlator_t * xl, fd_t * fd, struct iovec * vector, int32_t count, off_t offset, uint32_t flags, struct iobref * iobref, dict_t * xdata)
+int32_t reconfigure(xlator_t * xl, dict_t * options)
 {
-    heal_inode_ctx_t * inode_ctx;
-    heal_fd_ctx_t * fd_ctx;
-    int32_t error, fd_healing;
-
-    LOCK(&fd->inode->lock);
-
-    fd_healing = 0;
-    error = __heal_inode_ctx_get(&inode_ctx, xl, fd->inode);
-    if (error == 0)
+    heal_private_t * priv;
+
+    priv = xl->private;
+
+    if ((xlator_option_reconf_bool(xl, options, "integrity-map", &priv->integrity) != 0) ||
+        (xlator_option_reconf_size(xl, options, "integrity-block-size", &priv->block_size) != 0) ||
+        (xlator_option_reconf_uint32(xl, options, "scrub-delay", &priv->scrub_delay) != 0) ||
+        (xlator_option_reconf_time(xl, options, "scrub-min-age", &priv->scrub_min_age) != 0) ||
+        (xlator_option_reconf_size(xl, options, "dirty-granularity", &priv->dirty_granularity) != 0) ||
+        (xlator_option_reconf_time(xl, options, "heal-lease-timeout", &priv->lease_timeout) != 0) ||
+        (xlator_option_reconf_size(xl, options, "inline-heal-size", &priv->inline_size) != 0) ||
+        (xlator_option_reconf_size(xl, options, "heal-readahead-window", &priv->readahead_window) != 0) ||
+        (xlator_option_reconf_size(xl, options, "heal-readahead-block", &priv->readahead_block) != 0) ||
+        (xlator_option_reconf_size(xl, options, "heal-granularity", &priv->granularity) != 0) ||
+        (xlator_option_reconf_uint32(xl, options, "heat-sample-rate", &priv->heat.sample_rate) != 0) ||
+        (xlator_option_reconf_time(xl, options, "heat-half-life", &priv->heat.half_life) != 0))
     {
-        if (heal_fd_ctx_get(&fd_ctx, xl, fd) == 0)
-        {
-            fd_healing = fd_ctx->healing;
-        }
-        if (inode_ctx->healing == 0)
-        {
-            if (fd_healing != 0)
-            {
-                gf_log(xl->name, GF_LOG_ERROR, "Heal request to non healing file");
+        return -1;
+    }
+    priv->scrub.delay = priv->scrub_delay;
+    priv->scrub.min_age = priv->scrub_min_age;
 
-                error = EPERM;
+    return 0;
+}
 
-                goto failed;
-            }
-        }
-        else
-        {
-            if (fd_healing == 0)
-            {
-                if (inode_ctx->offset < offset + iov_length(vector, count))
-                {
-                    gf_log(xl->name, GF_LOG_ERROR, "Bad offset writing to file being healed (%lX - %lX)", offset, inode_ctx->offset);
+int32_t fini(xlator_t * xl)
+{
+    heal_private_t * priv;
 
-                    error = EPERM;
+    priv = xl->private;
+    if (priv != NULL)
+    {
+        xl->private = NULL;
 
-                    goto failed;
-                }
-            }
-            else
-            {
-                if (offset != inode_ctx->offset)
-                {
-                    gf_log(xl->name, GF_LOG_ERROR, "Bad offset healing (%lX - %lX)", offset, inode_ctx->offset);
+        heal_scrub_stop(&priv->scrub);
+        heal_registry_destroy(&priv->registry);
+        heal_heat_destroy(&priv->heat);
+        heal_trace_destroy();
 
-                    error = EPERM;
+        GF_FREE(priv);
+    }
 
-                    goto failed;
-                }
+    return 0;
+}
 
-                UNLOCK(&fd->inode->lock);
+int32_t init(xlator_t * xl)
+{
+    heal_private_t * priv;
 
-                STACK_WIND_COOKIE(frame, heal_writev_cbk, inode_ref(fd->inode), FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->writev, fd, vector, count, offset, flags, iobref, xdata);
+    if ((xl->children == NULL) || (xl->children->next != NULL))
+    {
+        gf_log(xl->name, GF_LOG_ERROR, "The heal translator needs a single subvolume");
 
-                return 0;
-            }
-        }
+        return -1;
     }
 
-    if (error == 0)
+    priv = GF_CALLOC(1, sizeof(heal_private_t), gf_heal_mt_heal_private_t);
+    if (priv == NULL)
     {
-        UNLOCK(&fd->inode->lock);
-
-        STACK_WIND(frame, default_writev_cbk, FIRST_CHILD(xl), FIRST_CHILD(xl)->fops->writev, fd, vector, count, offset, flags, iobref, xdata);
+        return -1;
+    }
+    xl->private = priv;
+
+    heal_registry_init(&priv->registry);
+    heal_heat_init(&priv->heat);
+    heal_trace_init();
+
+    if ((xlator_option_init_bool(xl, xl->options, "integrity-map", &priv->integrity) != 0) ||
+        (xlator_option_init_size(xl, xl->options, "integrity-block-size", &priv->block_size) != 0) ||
+        (xlator_option_init_uint32(xl, xl->options, "scrub-delay", &priv->scrub_delay) != 0) ||
+        (xlator_option_init_time(xl, xl->options, "scrub-min-age", &priv->scrub_min_age) != 0) ||
+        (xlator_option_init_size(xl, xl->options, "dirty-granularity", &priv->dirty_granularity) != 0) ||
+        (xlator_option_init_time(xl, xl->options, "heal-lease-timeout", &priv->lease_timeout) != 0) ||
+        (xlator_option_init_size(xl, xl->options, "inline-heal-size", &priv->inline_size) != 0) ||
+        (xlator_option_init_size(xl, xl->options, "heal-readahead-window", &priv->readahead_window) != 0) ||
+        (xlator_option_init_size(xl, xl->options, "heal-readahead-block", &priv->readahead_block) != 0) ||
+        (xlator_option_init_size(xl, xl->options, "heal-granularity", &priv->granularity) != 0) ||
+        (xlator_option_init_bool(xl, xl->options, "content-generation", &priv->generation) != 0) ||
+        (xlator_option_init_uint32(xl, xl->options, "heat-sample-rate", &priv->heat.sample_rate) != 0) ||
+        (xlator_option_init_time(xl, xl->options, "heat-half-life", &priv->heat.half_life) != 0))
+    {
+        goto failed;
+    }
 
-        return 0;
+    // The scrubber is always started so that the integrity map can be
+    // enabled later through reconfiguration.
+    if (heal_scrub_start(xl, &priv->scrub, priv->scrub_delay, priv->scrub_min_age) != 0)
+    {
+        goto failed;
     }
 
-failed:
-    UNLOCK(&fd->inode->lock);
+    return 0;
 
-    STACK_UNWIND_STRICT(writev, frame, -1, error, NULL, NULL, NULL);
+failed:
+    fini(xl);
 
-    return 0;
+    return -1;
 }
 
-int32_t fini(xlator_t * xl)
+int32_t heal_priv_dump(xlator_t * xl)
 {
-    return 0;
-}
+    char key_prefix[GF_DUMP_MAX_BUF_LEN];
+    heal_private_t * priv;
+
+    priv = xl->private;
+    if (priv == NULL)
+    {
+        return 0;
+    }
+
+    gf_proc_dump_build_key(key_prefix, "xlator.features.heal", "priv");
+    gf_proc_dump_add_section(key_prefix);
+
+    gf_proc_dump_write("integrity-map", "%d", priv->integrity);
+    gf_proc_dump_write("integrity-block-size", "%lu", priv->block_size);
+    heal_scrub_dump(&priv->scrub);
+    heal_registry_dump(&priv->registry);
+    heal_trace_dump();
+    heal_compress_dump(&priv->compress);
+    gf_proc_dump_write("check.skipped", "%lu", priv->check_skipped);
+    gf_proc_dump_write("check.skipped-bytes", "%lu", priv->check_skipped_bytes);
+    gf_proc_dump_write("dirty-generation", "%lu", priv->dirty_gen);
+    gf_proc_dump_write("dirty-granularity", "%lu", priv->dirty_granularity);
+    gf_proc_dump_write("heal-lease-timeout", "%u", priv->lease_timeout);
+    gf_proc_dump_write("inline-heal-size", "%lu", priv->inline_size);
+    gf_proc_dump_write("heal-readahead-window", "%lu", priv->readahead_window);
+    gf_proc_dump_write("heal-readahead-block", "%lu", priv->readahead_block);
+    gf_proc_dump_write("stream.reads", "%lu", priv->stream_reads);
+    gf_proc_dump_write("stream.waits", "%lu", priv->stream_waits);
+    gf_proc_dump_write("stream.bytes", "%lu", priv->stream_bytes);
+    gf_proc_dump_write("stream.readahead-bytes", "%lu", priv->stream_readahead);
+    gf_proc_dump_write("heal-granularity", "%lu", priv->granularity);
+    gf_proc_dump_write("granularity.unaligned-writes", "%lu", priv->unaligned_writes);
+    gf_proc_dump_write("granularity.unaligned-bytes", "%lu", priv->unaligned_bytes);
+    gf_proc_dump_write("granularity.conflicts", "%lu", priv->unaligned_conflicts);
+    gf_proc_dump_write("content-generation", "%d", priv->generation);
+    heal_heat_dump(&priv->heat);
 
-int32_t init(xlator_t * xl)
-{
     return 0;
 }
 
@@ -710,6 +5941,13 @@ int32_t heal_forget(xlator_t * xl, inode_t * inode)
     if ((error == 0) && (value != 0))
     {
         inode_ctx = (heal_inode_ctx_t *)(uintptr_t)value;
+        if (inode_ctx->map != NULL)
+        {
+            heal_map_destroy(inode_ctx->map);
+        }
+        heal_ranges_clear(&inode_ctx->dirty);
+        heal_ranges_clear(&inode_ctx->dirty_pending);
+        heal_ranges_clear(&inode_ctx->written);
 
         GF_FREE(inode_ctx);
     }
@@ -733,7 +5971,12 @@ int32_t heal_release(xlator_t * xl, fd_t * fd)
         fd_ctx = (heal_fd_ctx_t *)(uintptr_t)value;
         if (fd_ctx->healing != 0)
         {
-            heal_inode_clear_healing(xl, fd->inode);
+            heal_trace(HEAL_TRACE_RELEASE, fd->inode->gfid, fd_ctx->lease, 0);
+            heal_inode_clear_healing(xl, fd->inode, fd_ctx->lease);
+        }
+        if (fd_ctx->stream != NULL)
+        {
+            heal_stream_destroy(fd_ctx->stream);
         }
         GF_FREE(fd_ctx);
     }
@@ -764,21 +6007,21 @@ struct xlator_fops fops =
     .lookup       = heal_lookup,
     .mkdir        = NULL,
     .mknod        = NULL,
-    .open         = NULL,
+    .open         = heal_open,
     .opendir      = NULL,
     .rchecksum    = heal_rchecksum,
     .readdir      = NULL,
-    .readdirp     = NULL,
+    .readdirp     = heal_readdirp,
     .readlink     = NULL,
     .readv        = heal_readv,
-    .removexattr  = NULL,
-    .fremovexattr = NULL,
+    .removexattr  = heal_removexattr,
+    .fremovexattr = heal_fremovexattr,
     .rename       = NULL,
     .rmdir        = NULL,
-    .setattr      = NULL,
-    .fsetattr     = NULL,
-    .setxattr     = NULL,
-    .fsetxattr    = NULL,
+    .setattr      = heal_setattr,
+    .fsetattr     = heal_fsetattr,
+    .setxattr     = heal_setxattr,
+    .fsetxattr    = heal_fsetxattr,
     .stat         = heal_stat,
     .fstat        = heal_fstat,
     .statfs       = NULL,
@@ -787,8 +6030,8 @@ struct xlator_fops fops =
     .ftruncate    = heal_ftruncate,
     .unlink       = heal_unlink,
     .writev       = heal_writev,
-    .xattrop      = NULL,
-    .fxattrop     = NULL
+    .xattrop      = heal_xattrop,
+    .fxattrop     = heal_fxattrop
 };
 
 struct xlator_cbks cbks =
@@ -797,3 +6040,135 @@ struct xlator_cbks cbks =
     .release      = heal_release,
     .releasedir   = NULL
 };
+
+struct xlator_dumpops dumpops =
+{
+    .priv         = heal_priv_dump
+};
+
+struct volume_options options[] =
+{
+    {
+        .key = { "integrity-map" },
+        .type = GF_OPTION_TYPE_BOOL,
+        .default_value = "off",
+        .description = "Compute a checksum of each block written by a heal "
+                       "and store them in the " HEAL_KEY_MAP " xattr of the "
+                       "file once the heal completes. Healed files are then "
+                       "verified in background."
+    },
+    {
+        .key = { "integrity-block-size" },
+        .type = GF_OPTION_TYPE_SIZET,
+        .min = 4096,
+        .max = 1073741824,
+        .default_value = "1MB",
+        .description = "Minimum size of the blocks of the integrity map. It "
+                       "is increased for big files."
+    },
+    {
+        .key = { "scrub-delay" },
+        .type = GF_OPTION_TYPE_INT,
+        .min = 0,
+        .max = 60000,
+        .default_value = "10",
+        .description = "Milliseconds to wait between two blocks verified by "
+                       "the scrubber."
+    },
+    {
+        .key = { "scrub-min-age" },
+        .type = GF_OPTION_TYPE_TIME,
+        .min = 0,
+        .max = 86400,
+        .default_value = "600",
+        .description = "Seconds to wait after a heal before verifying the "
+                       "file, so that the data is read from disk instead of "
+                       "from the page cache."
+    },
+    {
+        .key = { "dirty-granularity" },
+        .type = GF_OPTION_TYPE_SIZET,
+        .min = 4096,
+        .max = 1073741824,
+        .default_value = "1MB",
+        .description = "Granularity of the ranges recorded in the dirty "
+                       "region journal."
+    },
+    {
+        .key = { "heal-lease-timeout" },
+        .type = GF_OPTION_TYPE_TIME,
+        .min = 0,
+        .max = 86400,
+        .default_value = "60",
+        .description = "Seconds without heal requests after which another "
+                       "healer can take over a heal in progress. 0 disables "
+                       "takeovers."
+    },
+    {
+        .key = { "inline-heal-size" },
+        .type = GF_OPTION_TYPE_SIZET,
+        .min = 0,
+        .max = 1048576,
+        .default_value = "64KB",
+        .description = "Maximum size of the files that can be healed with "
+                       "a single create request."
+    },
+    {
+        .key = { "heal-readahead-window" },
+        .type = GF_OPTION_TYPE_SIZET,
+        .min = 0,
+        .max = 268435456,
+        .default_value = "4MB",
+        .description = "Amount of data read in advance for sequential reads "
+                       "of heal sources. 0 disables the readahead."
+    },
+    {
+        .key = { "heal-readahead-block" },
+        .type = GF_OPTION_TYPE_SIZET,
+        .min = 4096,
+        .max = 16777216,
+        .default_value = "128KB",
+        .description = "Size of each read sent to the brick to fill the "
+                       "readahead of heal sources."
+    },
+    {
+        .key = { "heal-granularity" },
+        .type = GF_OPTION_TYPE_SIZET,
+        .min = 0,
+        .max = 67108864,
+        .default_value = "0",
+        .description = "Unit to which heal ranges are aligned. It should "
+                       "match the stripe size of dispersed bricks so that "
+                       "heals never cause read-modify-write cycles. 0 "
+                       "disables the alignment."
+    },
+    {
+        .key = { "content-generation" },
+        .type = GF_OPTION_TYPE_BOOL,
+        .default_value = "off",
+        .description = "Counts the modifications of the contents of each "
+                       "file and returns the count in lookup. Changes "
+                       "need a restart, since modifications made while "
+                       "disabled wouldn't be counted."
+    },
+    {
+        .key = { "heat-sample-rate" },
+        .type = GF_OPTION_TYPE_INT,
+        .min = 0,
+        .max = 65536,
+        .default_value = "16",
+        .description = "Only one out of this number of reads and writes is "
+                       "used to track the hottest files. 0 disables the "
+                       "tracking."
+    },
+    {
+        .key = { "heat-half-life" },
+        .type = GF_OPTION_TYPE_TIME,
+        .min = 1,
+        .max = 86400,
+        .default_value = "600",
+        .description = "Seconds after which the heat of a file that is not "
+                       "accessed anymore is halved."
+    },
+    { .key = { NULL } }
+};
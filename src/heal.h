@@ -23,15 +23,181 @@
 
 #include <mem-types.h>
 
+#include "heal-scrub.h"
+#include "heal-registry.h"
+#include "heal-compress.h"
+#include "heal-trace.h"
+#include "heal-heat.h"
+
 #define HEAL_KEY_FLAGS "trusted.heal.flags"
 #define HEAL_KEY_SIZE  "trusted.heal.size"
 
+#define HEAL_KEY_VERSION "trusted.heal.version"
+#define HEAL_KEY_ATTR    "trusted.heal.attr"
+#define HEAL_KEY_REMOVE  "trusted.heal.remove"
+
+/* Reply of a metadata heal that has failed after starting to apply the
+ * changes: the step that failed and its errno. */
+#define HEAL_KEY_META_STEP  "trusted.heal.meta.step"
+#define HEAL_KEY_META_ERROR "trusted.heal.meta.error"
+
+enum
+{
+    HEAL_META_XATTRS,
+    HEAL_META_REMOVE,
+    HEAL_META_ATTRS,
+    HEAL_META_DONE
+};
+
+#define HEAL_KEY_MAP     "trusted.heal.map"
+#define HEAL_KEY_SCRUB   "trusted.heal.scrub"
+
+#define HEAL_KEY_DIRTY     "trusted.heal.dirty"
+#define HEAL_KEY_DIRTY_GEN "trusted.heal.dirty.generation"
+
+#define HEAL_KEY_ACTIVE "trusted.heal.active"
+#define HEAL_KEY_OFFSET "trusted.heal.offset"
+#define HEAL_KEY_STATS  "trusted.heal.stats"
+
+#define HEAL_KEY_COMPRESS "trusted.heal.compress"
+#define HEAL_KEY_RAW_SIZE "trusted.heal.raw-size"
+
+#define HEAL_KEY_CHECKSUM  "trusted.heal.checksum"
+#define HEAL_CHECKSUM_SIZE 16
+
+/* Multi-extent heal writes. HEAL_KEY_EXTENTS contains an array of
+ * heal_extent_t and the reply the errno of each extent in
+ * HEAL_KEY_EXTENT_RESULTS. */
+#define HEAL_KEY_EXTENTS        "trusted.heal.extents"
+#define HEAL_KEY_EXTENT_RESULTS "trusted.heal.extents.results"
+#define HEAL_KEY_SKIP           "trusted.heal.skip"
+#define HEAL_EXTENTS_MAX        1024
+
+#define HEAL_KEY_DATA   "trusted.heal.data"
+#define HEAL_KEY_XATTRS "trusted.heal.xattrs"
+#define HEAL_KEY_STATE  "trusted.heal.state"
+#define HEAL_KEY_RETRY  "trusted.heal.retry-after"
+#define HEAL_KEY_TRACE  "trusted.heal.trace"
+#define HEAL_KEY_SOURCE "trusted.heal.source"
+#define HEAL_KEY_PROGRESS "trusted.heal.progress"
+#define HEAL_KEY_HEAT     "trusted.heal.heat"
+
+/* Content generation of a file. The xattr stores the upper limit of the
+ * last batch of generations reserved. */
+#define HEAL_KEY_GENERATION   "trusted.heal.generation"
+#define HEAL_GENERATION_BATCH 1024
+
+/* Fingerprint of the xattrs of an inode. HEAL_KEY_PREFIX xattrs are not
+ * included because they describe the local state of each brick. */
+#define HEAL_KEY_FINGERPRINT "trusted.heal.fingerprint"
+#define HEAL_KEY_PREFIX      "trusted.heal."
+
+/* Options of heal source reads (HEAL_KEY_SOURCE). */
+#define HEAL_SOURCE_CHECKSUM 0x00000001
+
+/* Limits, in milliseconds, of the retry time returned to clients. */
+#define HEAL_RETRY_DEFAULT 1000
+#define HEAL_RETRY_MIN     10
+#define HEAL_RETRY_MAX     60000
+
+#define HEAL_STATS_SIZE 4096
+
+#define HEAL_FLAG_DATA     0x00000001
+#define HEAL_FLAG_METADATA 0x00000002
+#define HEAL_FLAG_TAKEOVER 0x00000004
+#define HEAL_FLAG_INLINE   0x00000008
+#define HEAL_FLAG_JOURNAL  0x00000010
+
+/* Attributes sent by a healer in HEAL_KEY_ATTR. All fields are stored in
+ * network byte order. 'valid' is a mask of GF_SET_ATTR_* flags. */
+typedef struct _heal_attr
+{
+    uint32_t valid;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t atime;
+    uint32_t atime_nsec;
+    uint64_t mtime;
+    uint32_t mtime_nsec;
+} __attribute__((__packed__)) heal_attr_t;
+
+/* Extent of a multi-extent heal write. All fields are stored in network
+ * byte order. */
+typedef struct _heal_extent
+{
+    uint64_t offset;
+    uint64_t length;
+} __attribute__((__packed__)) heal_extent_t;
+
+#define HEAL_STATE_HEALING 0x00000001
+#define HEAL_STATE_ABORTED 0x00000002
+
+/* Heal state returned in HEAL_KEY_STATE by lookup and readdirp. All fields
+ * are stored in network byte order. */
+typedef struct _heal_state
+{
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t size;
+} __attribute__((__packed__)) heal_state_t;
+
+typedef struct _heal_private
+{
+    gf_boolean_t integrity;
+    uint64_t block_size;
+    uint32_t scrub_delay;
+    uint32_t scrub_min_age;
+    heal_scrub_t scrub;
+    heal_registry_t registry;
+    uint64_t dirty_gen;
+    int32_t dirty_loaded;
+    uint64_t dirty_granularity;
+    uint32_t lease_timeout;
+    heal_compress_stats_t compress;
+    uint64_t check_skipped;
+    uint64_t check_skipped_bytes;
+    uint64_t inline_size;
+    uint64_t readahead_window;
+    uint64_t readahead_block;
+    uint64_t stream_reads;
+    uint64_t stream_waits;
+    uint64_t stream_bytes;
+    uint64_t stream_readahead;
+    uint64_t granularity;
+    uint64_t unaligned_writes;
+    uint64_t unaligned_bytes;
+    uint64_t unaligned_conflicts;
+    gf_boolean_t generation;
+    heal_heat_t heat;
+} heal_private_t;
+
 enum gf_heal_mem_types_
 {
     gf_heal_mt_heal_inode_ctx_t = gf_common_mt_end + 1,
     gf_heal_mt_heal_fd_ctx_t,
     gf_heal_mt_uint8_t,
+    gf_heal_mt_heal_meta_local_t,
+    gf_heal_mt_heal_write_local_t,
+    gf_heal_mt_iovec_t,
+    gf_heal_mt_heal_unlink_local_t,
+    gf_heal_mt_heal_private_t,
+    gf_heal_mt_heal_map_t,
+    gf_heal_mt_heal_scrub_entry_t,
+    gf_heal_mt_heal_range_t,
+    gf_heal_mt_heal_dirty_local_t,
+    gf_heal_mt_heal_registry_entry_t,
+    gf_heal_mt_heal_inline_local_t,
+    gf_heal_mt_heal_trace_ring_t,
+    gf_heal_mt_heal_stream_t,
+    gf_heal_mt_heal_stream_block_t,
+    gf_heal_mt_heal_xattrop_local_t,
+    gf_heal_mt_heal_heat_entry_t,
+    gf_heal_mt_heal_fingerprint_local_t,
+    gf_heal_mt_heal_extents_local_t,
     gf_heal_mt_end
 };
 
+uint64_t heal_data_version(xlator_t * xl, inode_t * inode);
+
 #endif /* __HEAL_H__ */